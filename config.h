@@ -11,18 +11,29 @@
 #include <ctype.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <limits.h>
 #include <stdio.h>
 #include <stdarg.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <sys/types.h>
+#include <sys/uio.h>
 #include <unistd.h>
 #include <termios.h>
 #include <time.h>
 
 #include <locale.h>
 #include <ncurses.h>
+#include <poll.h>
+#include <pthread.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
 /*
 ** Defines
@@ -32,6 +43,30 @@
 #define KILONE_VERSION "0.1.0"
 #define KILONE_TAB_STOP 4
 #define KILONE_QUIT_TIMES 3
+#define KILONE_SAVE_IOV 256 // pieces handed to one writev when saving
+#define KILONE_SAVE_COPY_MAX (64<<20) // mapped bytes a save may copy to update the file in place
+#define KILONE_UNDO_BLOCK (64<<10) // bytes per undo log block
+#define KILONE_UNDO_MAX (32<<20) // undo history kept at most, oldest steps go first
+#define KILONE_SLAB_SIZE (64<<10) // row storage slabs, aligned to their size
+#define KILONE_SLAB_CLASSES 10 // size classes 16, 32, .. 8192 bytes, bigger blocks get a slab each
+#define KILONE_ROPE_CHUNK 64 // rows stored per text buffer node
+#define KILONE_RX_STEP 4096 // bytes of a long row between screen column checkpoints
+#define KILONE_LONG_ROW (1<<20) // rows this long keep their highlight in chunks
+#define KILONE_HL_CHUNK (64<<10) // bytes of a long row per highlight chunk
+#define KILONE_SEARCH_MAX_MATCHES (1<<22) // matches indexed at once
+#define KILONE_SEARCH_BATCH 512 // matches the search worker hands over at once
+#define KILONE_SEARCH_SLICE (1<<20) // bytes scanned between cancellation checks
+#define KILONE_STATUS_MS 5000 // how long a status message stays
+#define KILONE_ESC_MS 20 // how long an ESC waits for the rest of a sequence, KILONE_ESC_MS in the environment overrides it
+#define KILONE_PASTE_MS 500 // a bracketed paste that goes quiet this long without its end marker is taken as is
+#define KILONE_INPUT_BUF 4096 // bytes read from the terminal at once
+#define KILONE_LOOP_WATCHES 8 // file descriptors the event loop can watch
+#define KILONE_LOOP_TIMERS 8 // timers that can be pending at once
+#define KILONE_FPS 60 // frames drawn at most per second while keys keep coming
+#define KILONE_REGEX_MAX_INSTS 20000 // nfa size a pattern may compile to
+#define KILONE_REGEX_MAX_STATES 1024 // dfa states cached before starting over
+#define KILONE_REGEX_MAX_REPEAT 1000 // biggest count allowed in {m,n}
+#define KILONE_REGEX_MAX_PREFIX 64
 
 enum editorKey {
     BACKSPACE = 127,
@@ -46,6 +81,10 @@ enum editorKey {
     PAGE_DOWN,
     KILONE_QUIT,
     KILONE_SAVE,
+    KILONE_TICK, // no key arrived while a background job was running
+    KILONE_PASTE_BEGIN, // bracketed paste markers
+    KILONE_PASTE_END,
+    KILONE_PASTE, // a whole bracketed paste, its text is in EDITOR.paste
 };
 
 enum editorHighlight {
@@ -63,18 +102,59 @@ enum editorHighlight {
 #define KILONE_HL_HIGHLIGHT_NUMBERS (1<<0)
 #define KILONE_HL_HIGHLIGHT_STRINGS (1<<1)
 
+// character classes used by the lexer
+#define KILONE_CC_SEPARATOR (1<<0)
+#define KILONE_CC_DIGIT (1<<1)
+#define KILONE_CC_SPECIAL (1<<2) // may start a comment or a string
+
 enum editorMode {
 KILONE_MODE_NORMAL = 0,
 KILONE_MODE_INSERT,
 KILONE_MODE_VISUAL,
 };
 
+// how frames reach the terminal, picked with the KILONE_RENDERER
+// environment variable ("curses" or "vt")
+enum editorRenderer {
+KILONE_RENDERER_CURSES = 0,
+KILONE_RENDERER_VT, // escape sequences built in one buffer, one write()
+};
+#define KILONE_DEFAULT_RENDERER KILONE_RENDERER_CURSES
+
 /*
  * Data
 */
 typedef int err_no;
 typedef int keycode;
 
+// growable output buffer, kept between frames
+struct abuf {
+    char *b;
+    int len;
+    int cap;
+};
+
+#define ABUF_INIT {NULL, 0, 0}
+
+struct editorKeyword {
+    char *word;
+    int len;
+    unsigned char hl; // KILONE_HL_KEYWORD1 or KILONE_HL_KEYWORD2
+};
+
+// lookup tables built from an editorSyntax at startup
+struct editorLexer {
+    unsigned char cclass[256]; // KILONE_CC_* flags of every byte
+    int scs_len, mcs_len, mce_len;
+    int simdwords, simdblanks; // whether the vector skip loops apply
+    int lookahead; // how far past a byte the lexer may read to classify it
+
+    // keywords in an open addressing hash table
+    struct editorKeyword *kwtable;
+    unsigned int kwmask; // table size - 1
+    int kwmaxlen;
+};
+
 struct editorSyntax {
     char *filetype;
     char **filematch;
@@ -83,31 +163,389 @@ struct editorSyntax {
     char *multiline_comment_start;
     char *multiline_comment_end;
     int flags;
+    struct editorLexer *lexer;
+};
+
+// a run of bytes in one highlight class. bytes no span covers
+// are KILONE_HL_NORMAL, which is most of them
+struct hlSpan {
+    int start;
+    int len;
+    unsigned char hl;
+};
+
+// spans as the lexer emits them, in order and not overlapping
+struct hlBuffer {
+    struct hlSpan *spans;
+    int count;
+    int cap;
+};
+
+// a piece of the highlight of a long row. besides its spans a chunk keeps
+// the first place in it the lexer can restart from, so the chunks that
+// are drawn can be lexed without lexing the row from its start
+struct hlChunk {
+    int len; // bytes of the row it covers
+    int restart; // offset of the first restart in the chunk, -1 if none is known
+    int prev_sep; // lexer state at the restart
+    int hlsize; // packed spans, counted from the chunk start, -1 until drawn
+    unsigned char *spans;
+};
+
+struct hlChunks {
+    int n;
+    int cap;
+    struct hlChunk c[];
+};
+
+// a lexing pass over a long row notes the restart in every chunk it goes
+// through. meeting the restart a chunk past an edit already had, in the
+// same state, means the rest of the row lexes as it did before
+struct lexMarks {
+    struct hlChunks *chunks;
+    int k; // the next chunk to note
+    int start; // where chunk k starts
+    int converge; // first chunk past the edit, chunks->n if there is none
+    int converged;
+};
+
+// screen columns of a long row every KILONE_RX_STEP bytes, so cursor and
+// screen columns map without walking the row from its start. built only
+// as far as it was needed, and cut back to an edit when one is made
+struct rxIndex {
+    int n; // checkpoints that are up to date
+    int cap;
+    int rx[]; // the column chars[k * KILONE_RX_STEP] starts at
 };
 
 typedef struct erow {
-    int idx;
     int size;
-    int rsize;
+    int gen; // save generation chars were allocated in
     char *chars;
-    char *render;
-    unsigned char *highlight;
-    int hl_open_comment;
+    // highlight spans packed by editorRowSetHighlight, kept in the row
+    // itself while they fit
+    union {
+        unsigned char *ptr;
+        struct hlChunks *chunks;
+        unsigned char bytes[sizeof(unsigned char *)];
+    } highlight;
+    struct rxIndex *rxindex; // NULL until the row is long enough to need it
+    int hlsize; // packed bytes, -1 if the row is long and kept in chunks
+    signed char hl_start; // lexer state the row was highlighted from, -1 if stale
+    signed char hl_open_comment; // lexer state the row ends in
+    unsigned char mapped; // chars still point into the file mapping
+    unsigned char ready; // drawn at some point, so its highlight is kept
 } erow;
 
+// regex parse tree
+enum regexNodeOp {
+RXN_EMPTY = 0,
+RXN_SET, // one byte out of a set
+RXN_BOL,
+RXN_EOL,
+RXN_CAT,
+RXN_ALT,
+RXN_REPEAT, // child between min and max times, max -1 for no limit
+};
+
+struct regexNode {
+    int op;
+    int set;
+    int min, max;
+    int left, right; // children, indices into regex.nodes
+};
+
+// regex nfa instructions
+enum regexOp {
+RX_SET = 0, // consume a byte in set
+RX_ANY, // consume any symbol
+RX_BOL, // consume the start of line symbol
+RX_EOL, // consume the end of line symbol
+RX_SPLIT, // continue at both out and out1
+RX_MATCH,
+};
+
+struct regexInst {
+    int op;
+    int set;
+    int out, out1;
+};
+
+struct regexSet {
+    unsigned char bits[32];
+};
+
+// one direction of a compiled pattern: the nfa and the dfa states built
+// from it so far. a dfa state is a sorted set of nfa instructions, its
+// transitions are filled in the first time they are taken
+struct regexProg {
+    struct regexInst *inst;
+    int ninst, instcap;
+    int start; // nfa entry
+    int nsym;
+
+    int nstates;
+    int startstate; // -1 until built
+    int *setoff, *setlen; // every state's set, in pool
+    int *pool;
+    int poolsize, poolcap;
+    int *next; // nstates x nsym: -2 not built yet, -1 no match possible
+    unsigned char *accept;
+    int *table; // set hash -> state, open addressing
+    unsigned int tablemask;
+
+    // scratch for building states
+    int *scratch, *stack;
+    unsigned int *mark;
+    unsigned int gen;
+};
+
+// a compiled pattern. rows are matched as a stream of symbols: a start of
+// line symbol, one per byte class, and an end of line symbol
+struct regex {
+    struct regexNode *nodes;
+    int nnodes, nodecap;
+    struct regexSet *sets;
+    int nsets, setcap;
+    const char *error;
+
+    unsigned char bclass[256]; // byte -> symbol
+    unsigned char rep[256]; // symbol -> a byte of that class
+    int nsym, bol, eol;
+
+    char prefix[KILONE_REGEX_MAX_PREFIX]; // every match starts with this
+    int prefix_len;
+
+    struct regexProg fwd; // anchored, finds where a match ends
+    struct regexProg rev; // reversed and unanchored, finds where matches start
+};
+
+struct searchMatch {
+    int row;
+    int col; // offset into chars
+    size_t off; // where the row starts in the mapping, if it wasn't indexed
+};
+
+// a place in the file a scan got to. rows past the indexed ones are read
+// straight from the mapping, so a search never has to index the file
+struct searchPos {
+    int row, col;
+    size_t off; // where row starts in the mapping, if it isn't indexed
+    int wrapped; // went past the end of the file and on from its start
+};
+
+// what the search worker found and hasn't handed over yet
+struct searchBatch {
+    struct searchMatch m[KILONE_SEARCH_BATCH];
+    int n;
+    int found;
+    int *starts, startcap; // regex match starts of the current row
+};
+
+// Ctrl-F state: every match of the query, in file order starting at the
+// anchor the index was built from and wrapping around the end.
+// the file is scanned from the anchor to its end, then from its start
+// back to the anchor column
+struct editorSearch {
+    int active;
+    char *query; // the query the index was built for
+    int qlen;
+    int regex; // the query is a pattern, toggled with Ctrl-R
+    struct regex *re; // the compiled query in regex mode
+    const char *error; // why the pattern didn't compile
+    struct searchMatch *matches;
+    int nmatches, cap;
+    int current; // selected match, -1 if none
+    int origin_row, origin_col; // cursor when the search started
+    int anchor_row, anchor_col; // the scan starts here and comes back to it
+    struct searchPos scanned; // the index is complete up to here
+    int complete; // scanned all the way around to the anchor
+
+    // a worker thread extends the index in the background. the rows can't
+    // change while the search prompt is open, editorIndexRows stops it
+    // while it adds rows, and the worker is joined before the prompt
+    // closes, so it reads them without copying. query, anchor
+    // and job_* are only written while no worker runs
+    pthread_t worker;
+    int running; // a worker was started and is not joined yet
+    int cancel; // asks the worker to stop, accessed atomically
+    struct searchPos job; // where the worker starts
+    int job_numrows; // rows indexed when it started, the rest it reads
+    size_t job_mapoff; // from the mapping, starting here
+    int job_room; // how many matches it may add
+    pthread_mutex_t lock;
+    struct searchMatch *pending; // found, not picked up yet (lock)
+    int npending, pending_cap; // (lock)
+    struct searchPos reached; // where the worker got to (lock)
+    int worker_done; // the worker returned (lock)
+
+    // the selected match, drawn over the row's own highlight
+    int overlay_row; // -1 if nothing is overlaid
+    int overlay_start, overlay_end; // columns in chars
+};
+
+// row storage. text and highlight buffers and rope nodes are
+// carved from slabs of KILONE_SLAB_SIZE bytes that each serve one power
+// of two size class. a slab starts with this header and is aligned to
+// its size, so any block finds its class without a header of its own.
+// the header is four words, 16 or 32 bytes, so blocks stay 16 byte
+// aligned. it takes the room of one block, a slab of the 8192 byte
+// class holds 7
+struct slab {
+    struct slab *prev, *next; // every slab, for releasing them together
+    int cls; // size class, -1 for a slab holding a single big block
+    size_t size; // bytes of the big block
+};
+
+struct slabClass {
+    void *free; // freed blocks, linked through their first bytes
+    char *bump, *end; // what is left of the newest slab
+};
+
+struct slabStore {
+    struct slab *slabs;
+    struct slabClass cls[KILONE_SLAB_CLASSES];
+};
+
+// Text buffer: a treap of row chunks ordered by row number.
+// every node keeps the row count of its subtree so a row can be
+// found, inserted or removed in O(log n) without renumbering anything
+struct ropeNode {
+    struct ropeNode *left, *right;
+    int prio;
+    int count; // rows in this subtree
+    int nrows; // rows in this chunk
+    int gen; // save generation the node was allocated in
+    erow rows[KILONE_ROPE_CHUNK];
+};
+
+// a save in progress. the writer thread writes the tree as it was when
+// the save started, while the editor keeps changing it: nodes and row
+// text from an older generation than the snapshot are shared with the
+// writer and get copied before they are changed (see ropeOwn), the old
+// copies are freed once the writer is joined
+struct editorSaveJob {
+    int running; // a writer was started and is not joined yet
+    int gen; // generation of the snapshot
+    pthread_t worker;
+    struct ropeNode *rows; // the snapshot
+    char *map;
+    size_t mapsize, mapoff;
+    int dirty; // EDITOR.dirty when the snapshot was taken
+    int inplace; // only write the rows that changed into the file itself
+    size_t length; // file length after an in place save
+    size_t ondisk; // how much of the mapping the file still backs
+    size_t off; // where the writer is in the file (in place)
+    struct stat st; // the file after an in place save
+    char *path, *tmp;
+    mode_t mode;
+    size_t written; // bytes written so far, accessed atomically
+    int done; // the writer returned, accessed atomically
+    int err; // errno of a failed save, 0 if it worked
+    void **garbage; // shared memory the editor let go of
+    int ngarbage, garbage_cap;
+};
+
+// undo log. records are appended to a chain of blocks, each one a struct
+// undoRecord followed by its text. an op and its inverse only differ in
+// the lowest bit
+enum undoOp {
+UNDO_INSERT_TEXT = 0,
+UNDO_DELETE_TEXT,
+UNDO_INSERT_ROWS, // col is the row count, every row in the text ends in \n
+UNDO_DELETE_ROWS,
+};
+
+struct undoRecord {
+    int op;
+    int group; // first record of an undo step
+    int row, col;
+    int len; // bytes of text after the record
+    int cx, cy; // cursor before the step (group)
+    int redo_cx, redo_cy; // cursor after it, noted when undone (group)
+    long prev; // offset of the record before it in the block, -1 if none
+};
+
+struct undoBlock {
+    struct undoBlock *prev, *next;
+    long used, cap;
+    long last; // offset of the last record, -1 if none
+    long start; // records before it were dropped with an older block
+    char data[];
+};
+
+struct editorUndo {
+    struct undoBlock *first, *last;
+    // records before this point get undone, the ones from it on redone
+    struct undoBlock *top;
+    long top_off;
+    long size; // bytes held by all blocks
+    int depth; // editorUndoBegin nesting
+    int sealed; // the next record starts a new step
+    int cx, cy; // cursor when the outermost editorUndoBegin ran
+    int suspend; // not recording while set
+};
+
+// a file descriptor the event loop runs a callback for once it is
+// readable
+struct loopWatch {
+    int fd;
+    void (*callback)(int fd);
+};
+
+struct loopTimer {
+    long at; // monotonic ms it is due at
+    void (*callback)();
+};
+
+struct editorLoop {
+    struct loopWatch watches[KILONE_LOOP_WATCHES];
+    int nwatches;
+    struct loopTimer timers[KILONE_LOOP_TIMERS];
+    int ntimers;
+    int wake[2]; // worker threads write to wake[1] when they have news
+};
+
+// bytes from the terminal not decoded into keys yet
+struct editorInput {
+    unsigned char buf[KILONE_INPUT_BUF];
+    int off, len; // unread bytes are buf[off, len)
+    keycode next; // a key editorKeyPending decoded ahead, -1 if none
+    int esc_ms;
+};
+
 // Global Editor State
 struct editorConfig {
     int cx, cy; // cursor position
     int rx; // rendered cursor position
     int rowoff, coloff; // offset of the file
     int screenrows, screencols; // screen size
+    unsigned char *damage; // per screen line, whether it needs redrawing
+    int drawn_rowoff, drawn_coloff; // offsets the screen was last drawn at
+    enum editorRenderer renderer;
+    struct abuf frame; // escape sequences of the frame being drawn (vt)
+    int frame_color; // highlight the frame is currently drawing with (vt)
     int numrows;
-    erow *row;
+    struct ropeNode *rows;
+    struct slabStore store; // where rows and their buffers live
+    char *map; // the opened file, split into rows on demand
+    size_t mapsize;
+    size_t mapoff; // how far rows have been indexed into the mapping
+    struct stat disk; // the mapped file as last seen on disk
+    int disk_match; // it still holds the mapping's bytes
+    int hl_clean; // rows before this one have up to date lexer states
+    int hl_resume; // where the last highlight cascade cut the clean rows off
     int dirty;
     char *filename;
     char statusmsg[80];
-    time_t statusmsg_time;
+    long statusmsg_time; // editorNowMs() when it was set
     struct editorSyntax *syntax;
+    struct editorSearch search;
+    struct editorSaveJob save;
+    struct editorUndo undo;
+    struct abuf paste; // text of the last bracketed paste
+    struct editorLoop loop;
+    struct editorInput input;
     enum editorMode cur_mode;
     void (*keybindCallback)(keycode c);
 } EDITOR;
@@ -134,7 +572,8 @@ struct editorSyntax HLDB[] = {
         "/*",
         "*/",
         KILONE_HL_HIGHLIGHT_NUMBERS |
-        KILONE_HL_HIGHLIGHT_STRINGS
+        KILONE_HL_HIGHLIGHT_STRINGS,
+        NULL // lexer tables, built by editorCompileSyntax
     },
 };
 
@@ -154,5 +593,18 @@ void editorInitializeColorPairs(){
     init_pair(KILONE_HL_STATUS, COLOR_BLACK, COLOR_WHITE);
 }
 
+/* The same theme as SGR parameters, for the vt renderer */
+const char *KILONE_VT_COLORS[] = {
+    [KILONE_HL_NORMAL] = "37;40",
+    [KILONE_HL_COMMENT] = "36;40",
+    [KILONE_HL_MLCOMMENT] = "36;40",
+    [KILONE_HL_KEYWORD1] = "33;40",
+    [KILONE_HL_KEYWORD2] = "32;40",
+    [KILONE_HL_STRING] = "35;40",
+    [KILONE_HL_NUMBER] = "31;40",
+    [KILONE_HL_MATCH] = "34;40",
+    [KILONE_HL_STATUS] = "30;47",
+};
+
 
 #endif // KILONE_CONFIG_H_
@@ -11,6 +11,12 @@
 void editorSetStatusMessage(const char *fmt, ...);
 void editorRefreshScreen();
 char* editorPrompt(char *prompt, void (*callback)(char*, int));
+char *editorSearchMem(const char *hay, int hlen, const char *needle, int nlen);
+void editorCloseBuffer();
+void editorSearchStop();
+void editorSearchResume();
+void abAppend(struct abuf *ab, const char *s, int len);
+void abFree(struct abuf *ab);
 
 
 // mode callbacks
@@ -30,6 +36,7 @@ void die(const char *s){
     move(0,0);
     // put the cursor back jim
     write(STDOUT_FILENO, "\x1b[?25h", 6);
+    write(STDOUT_FILENO, "\x1b[?2004l", 8);
 
     perror(s);
     exit(1);
@@ -44,7 +51,9 @@ void enableRawMode() {
     nonl();
     raw();
     intrflush(stdscr, FALSE);
-    keypad(stdscr, TRUE);
+
+    // have pastes marked, so they go in as one edit instead of as keys
+    write(STDOUT_FILENO, "\x1b[?2004h", 8);
 }
 
 err_no getCursorPosition(int *rows, int* cols) {
@@ -58,6 +67,493 @@ err_no getWindowSize(int *rows, int *cols){
     return 0;
 }
 
+/*
+ * Event Loop
+ */
+
+// the editor sleeps in poll() on the terminal, the file descriptors
+// being watched and the next timer. callbacks run on the main thread, and
+// worker threads get it to wake up by writing to EDITOR.loop.wake
+
+long editorNowMs(){
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+void loopWatch(int fd, void (*callback)(int fd)){
+    struct editorLoop *l = &EDITOR.loop;
+    if(l->nwatches == KILONE_LOOP_WATCHES) die("loopWatch");
+    l->watches[l->nwatches].fd = fd;
+    l->watches[l->nwatches].callback = callback;
+    l->nwatches++;
+}
+
+void loopUnwatch(int fd){
+    struct editorLoop *l = &EDITOR.loop;
+    int j;
+    for(j = 0; j < l->nwatches; j++){
+        if(l->watches[j].fd != fd) continue;
+        l->watches[j] = l->watches[--l->nwatches];
+        return;
+    }
+}
+
+// runs callback once, `ms` from now. a timer with the same callback that
+// is still pending is moved instead
+void loopTimer(void (*callback)(), long ms){
+    struct editorLoop *l = &EDITOR.loop;
+    int j;
+    for(j = 0; j < l->ntimers && l->timers[j].callback != callback; j++);
+    if(j == l->ntimers){
+        if(l->ntimers == KILONE_LOOP_TIMERS) die("loopTimer");
+        l->ntimers++;
+    }
+    l->timers[j].at = editorNowMs() + ms;
+    l->timers[j].callback = callback;
+}
+
+// safe to call from any thread
+void loopWake(){
+    ssize_t n = write(EDITOR.loop.wake[1], "", 1);
+    (void)n;
+}
+
+// the wake up is all there is to it, whatever woke the loop is picked
+// up by its owner when the screen is drawn next
+void loopWoken(int fd){
+    char buf[64];
+    while(read(fd, buf, sizeof(buf)) > 0);
+}
+
+// sleeps until the terminal has input, a watched fd is readable or a
+// timer is due, and runs the callbacks of whatever happened
+void loopWait(){
+    struct editorLoop *l = &EDITOR.loop;
+    struct pollfd fds[KILONE_LOOP_WATCHES + 1];
+    int j;
+
+    long now = editorNowMs();
+    int wait = -1;
+    for(j = 0; j < l->ntimers; j++){
+        long left = l->timers[j].at - now;
+        if(left < 0) left = 0;
+        if(wait == -1 || left < wait) wait = left;
+    }
+
+    fds[0].fd = STDIN_FILENO;
+    fds[0].events = POLLIN;
+    for(j = 0; j < l->nwatches; j++){
+        fds[j + 1].fd = l->watches[j].fd;
+        fds[j + 1].events = POLLIN;
+    }
+    int n = l->nwatches;
+    if(poll(fds, n + 1, wait) == -1){
+        if(errno == EINTR) return;
+        die("poll");
+    }
+
+    // a callback may change the watches, so go by fd
+    for(j = 0; j < n; j++){
+        if(!(fds[j + 1].revents & (POLLIN | POLLHUP | POLLERR))) continue;
+        int k;
+        for(k = 0; k < l->nwatches; k++)
+            if(l->watches[k].fd == fds[j + 1].fd)
+                l->watches[k].callback(fds[j + 1].fd);
+    }
+
+    now = editorNowMs();
+    for(j = 0; j < l->ntimers; j++){
+        if(l->timers[j].at > now) continue;
+        void (*callback)() = l->timers[j].callback;
+        l->timers[j] = l->timers[--l->ntimers];
+        j--;
+        callback();
+    }
+}
+
+void loopInit(){
+    struct editorLoop *l = &EDITOR.loop;
+    l->nwatches = 0;
+    l->ntimers = 0;
+    if(pipe(l->wake) == -1) die("pipe");
+    // a worker never blocks on a full pipe, one byte in it is enough
+    fcntl(l->wake[0], F_SETFL, O_NONBLOCK);
+    fcntl(l->wake[1], F_SETFL, O_NONBLOCK);
+    loopWatch(l->wake[0], loopWoken);
+}
+
+/*
+ * Row Storage
+ */
+
+// row buffers are allocated and resized on every keystroke, and a big
+// file has millions of them. size classes give every buffer room to grow
+// into and slabs keep them together, so closing the buffer is a handful
+// of frees
+
+struct slab *slabOf(void *p){
+    return (struct slab *)((uintptr_t)p & ~(uintptr_t)(KILONE_SLAB_SIZE - 1));
+}
+
+struct slab *slabNew(size_t size){
+    void *mem;
+    if(posix_memalign(&mem, KILONE_SLAB_SIZE, size) != 0)
+        die("posix_memalign");
+    struct slab *s = mem;
+    struct slabStore *st = &EDITOR.store;
+    s->prev = NULL;
+    s->next = st->slabs;
+    if(st->slabs) st->slabs->prev = s;
+    st->slabs = s;
+    return s;
+}
+
+void *slabAlloc(size_t size){
+    int cls = 0;
+    while(cls < KILONE_SLAB_CLASSES && ((size_t)16 << cls) < size)
+        cls++;
+
+    if(cls == KILONE_SLAB_CLASSES){
+        struct slab *s = slabNew(sizeof(struct slab) + size);
+        s->cls = -1;
+        s->size = size;
+        return s + 1;
+    }
+
+    struct slabClass *c = &EDITOR.store.cls[cls];
+    size_t block = (size_t)16 << cls;
+    if(c->free){
+        void *p = c->free;
+        c->free = *(void **)p;
+        return p;
+    }
+    if(c->bump == NULL || c->end - c->bump < (long)block){
+        struct slab *s = slabNew(KILONE_SLAB_SIZE);
+        s->cls = cls;
+        c->bump = (char *)(s + 1);
+        c->end = (char *)s + KILONE_SLAB_SIZE;
+    }
+    void *p = c->bump;
+    c->bump += block;
+    return p;
+}
+
+// how many bytes the block at p can hold
+size_t slabCap(void *p){
+    struct slab *s = slabOf(p);
+    return s->cls < 0? s->size : (size_t)16 << s->cls;
+}
+
+void slabFree(void *p){
+    if(p == NULL) return;
+    struct slab *s = slabOf(p);
+    if(s->cls >= 0){
+        struct slabClass *c = &EDITOR.store.cls[s->cls];
+        *(void **)p = c->free;
+        c->free = p;
+        return;
+    }
+    if(s->prev) s->prev->next = s->next;
+    else EDITOR.store.slabs = s->next;
+    if(s->next) s->next->prev = s->prev;
+    free(s);
+}
+
+// only moves the block once it outgrows its size class. blocks past the
+// classes get some room to grow, so a long row growing byte by byte is
+// not copied on every byte
+void *slabRealloc(void *p, size_t size){
+    if(p && size <= slabCap(p)) return p;
+    if(p && size > ((size_t)16 << (KILONE_SLAB_CLASSES - 1)))
+        size += size / 8;
+    void *n = slabAlloc(size);
+    if(p){
+        memcpy(n, p, slabCap(p));
+        slabFree(p);
+    }
+    return n;
+}
+
+// frees every block at once
+void slabRelease(){
+    struct slab *s = EDITOR.store.slabs;
+    while(s){
+        struct slab *next = s->next;
+        free(s);
+        s = next;
+    }
+    memset(&EDITOR.store, 0, sizeof(EDITOR.store));
+}
+
+/*
+ * Text Buffer
+ */
+
+int ropeCount(struct ropeNode *t){
+    return t? t->count : 0;
+}
+
+void ropeUpdate(struct ropeNode *t){
+    t->count = ropeCount(t->left) + t->nrows + ropeCount(t->right);
+}
+
+struct ropeNode *ropeNewNode(){
+    struct ropeNode *t = slabAlloc(sizeof(struct ropeNode));
+    t->left = NULL;
+    t->right = NULL;
+    t->prio = rand();
+    t->count = 0;
+    t->nrows = 0;
+    t->gen = EDITOR.save.gen;
+    return t;
+}
+
+// frees p now, or once the running save is done with it
+void editorFreeLater(void *p, int gen){
+    struct editorSaveJob *j = &EDITOR.save;
+    if(!j->running || gen >= j->gen){
+        slabFree(p);
+        return;
+    }
+    if(j->ngarbage == j->garbage_cap){
+        j->garbage_cap = j->garbage_cap? j->garbage_cap * 2 : 64;
+        j->garbage = realloc(j->garbage, sizeof(void *) * j->garbage_cap);
+        if(j->garbage == NULL) die("realloc");
+    }
+    j->garbage[j->ngarbage++] = p;
+}
+
+// returns a node that can be changed in place, copying it first if the
+// running save still reads it. the caller relinks the copy
+struct ropeNode *ropeOwn(struct ropeNode *t){
+    if(t == NULL || !EDITOR.save.running || t->gen >= EDITOR.save.gen)
+        return t;
+    struct ropeNode *c = slabAlloc(sizeof(struct ropeNode));
+    memcpy(c, t, sizeof(struct ropeNode));
+    c->gen = EDITOR.save.gen;
+    editorFreeLater(t, t->gen);
+    return c;
+}
+
+// joins two treaps, every row of a comes before every row of b
+struct ropeNode *ropeMerge(struct ropeNode *a, struct ropeNode *b){
+    if(a == NULL) return b;
+    if(b == NULL) return a;
+
+    if(a->prio > b->prio){
+        a = ropeOwn(a);
+        a->right = ropeMerge(a->right, b);
+        ropeUpdate(a);
+        return a;
+    }
+    b = ropeOwn(b);
+    b->left = ropeMerge(a, b->left);
+    ropeUpdate(b);
+    return b;
+}
+
+// splits off the first k rows into l, k has to fall on a chunk boundary
+void ropeSplit(struct ropeNode *t, int k,
+               struct ropeNode **l, struct ropeNode **r){
+    if(t == NULL){
+        *l = *r = NULL;
+        return;
+    }
+
+    t = ropeOwn(t);
+    int lc = ropeCount(t->left);
+    if(k <= lc){
+        ropeSplit(t->left, k, l, &t->left);
+        *r = t;
+    } else {
+        ropeSplit(t->right, k - lc - t->nrows, &t->right, r);
+        *l = t;
+    }
+    ropeUpdate(t);
+}
+
+// finds the chunk that row `at` belongs in, an `at` sitting between
+// two chunks resolves to whichever is met first on the way down
+struct ropeNode *ropeLocate(int at, int *pos, int *start){
+    struct ropeNode *t = EDITOR.rows;
+    *start = 0;
+    while(t){
+        int lc = ropeCount(t->left);
+        if(at < lc){
+            t = t->left;
+        } else if(at <= lc + t->nrows){
+            *start += lc;
+            *pos = at - lc;
+            return t;
+        } else {
+            *start += lc + t->nrows;
+            at -= lc + t->nrows;
+            t = t->right;
+        }
+    }
+    return NULL;
+}
+
+erow *editorRowAt(int at){
+    if(at < 0 || at >= EDITOR.numrows) return NULL;
+
+    struct ropeNode *t = EDITOR.rows;
+    while(1){
+        int lc = ropeCount(t->left);
+        if(at < lc){
+            t = t->left;
+        } else if(at < lc + t->nrows){
+            return &t->rows[at - lc];
+        } else {
+            at -= lc + t->nrows;
+            t = t->right;
+        }
+    }
+}
+
+// like editorRowAt, for rows whose text is about to change
+erow *editorRowOwn(int at){
+    if(!EDITOR.save.running) return editorRowAt(at);
+    if(at < 0 || at >= EDITOR.numrows) return NULL;
+
+    struct ropeNode **link = &EDITOR.rows;
+    erow *row;
+    while(1){
+        struct ropeNode *t = *link = ropeOwn(*link);
+        int lc = ropeCount(t->left);
+        if(at < lc){
+            link = &t->left;
+        } else if(at < lc + t->nrows){
+            row = &t->rows[at - lc];
+            break;
+        } else {
+            at -= lc + t->nrows;
+            link = &t->right;
+        }
+    }
+
+    if(row->gen < EDITOR.save.gen && !row->mapped){
+        char *chars = slabAlloc(row->size + 1);
+        memcpy(chars,
+               row->chars,
+               row->size + 1);
+        editorFreeLater(row->chars, row->gen);
+        row->chars = chars;
+    }
+    row->gen = EDITOR.save.gen;
+    return row;
+}
+
+// opens an uninitialized slot for a new row at `at` and returns it
+erow *ropeInsertRow(int at){
+    if(EDITOR.rows == NULL)
+        EDITOR.rows = ropeNewNode();
+
+    int pos, start;
+    struct ropeNode *t;
+    // split full chunks in half until the row has room. rows appended
+    // to the end of a chunk, as when a file is read in, only move its last
+    // row out, so chunks stay full
+    while((t = ropeLocate(at, &pos, &start))->nrows == KILONE_ROPE_CHUNK){
+        struct ropeNode *a, *b, *mid;
+        ropeSplit(EDITOR.rows, start, &a, &b);
+        ropeSplit(b, t->nrows, &mid, &b);
+        t = mid; // the split may have copied it
+
+        int half = (pos == t->nrows)? t->nrows - 1 : KILONE_ROPE_CHUNK / 2;
+        struct ropeNode *n = ropeNewNode();
+        memcpy(n->rows,
+               &t->rows[half],
+               sizeof(erow) * (t->nrows - half));
+        n->nrows = t->nrows - half;
+        t->nrows = half;
+        ropeUpdate(t);
+        ropeUpdate(n);
+
+        EDITOR.rows = ropeMerge(a, ropeMerge(ropeMerge(t, n), b));
+    }
+
+    // walk down again the same way, this time counting the new row
+    struct ropeNode **link = &EDITOR.rows;
+    while(1){
+        t = *link = ropeOwn(*link);
+        t->count++;
+        int lc = ropeCount(t->left);
+        if(at < lc){
+            link = &t->left;
+        } else if(at <= lc + t->nrows){
+            pos = at - lc;
+            break;
+        } else {
+            at -= lc + t->nrows;
+            link = &t->right;
+        }
+    }
+
+    memmove(&t->rows[pos + 1],
+            &t->rows[pos],
+            sizeof(erow) * (t->nrows - pos));
+    t->nrows++;
+    return &t->rows[pos];
+}
+
+struct ropeNode *ropeDeleteRow(struct ropeNode *t, int at){
+    t = ropeOwn(t);
+    int lc = ropeCount(t->left);
+    if(at < lc){
+        t->left = ropeDeleteRow(t->left, at);
+    } else if(at < lc + t->nrows){
+        at -= lc;
+        memmove(&t->rows[at],
+                &t->rows[at + 1],
+                sizeof(erow) * (t->nrows - at - 1));
+        t->nrows--;
+        // empty chunks are dropped from the tree
+        if(t->nrows == 0){
+            struct ropeNode *r = ropeMerge(t->left, t->right);
+            slabFree(t);
+            return r;
+        }
+    } else {
+        t->right = ropeDeleteRow(t->right, at - lc - t->nrows);
+    }
+    ropeUpdate(t);
+    return t;
+}
+
+/*
+ * Screen Damage
+ */
+
+// screen lines only get redrawn once something marked them. the status
+// and message bars are the two lines below the rows
+
+void editorDamageLines(int from, int to){
+    if(from < 0) from = 0;
+    if(to > EDITOR.screenrows + 1) to = EDITOR.screenrows + 1;
+    for(; from <= to; from++)
+        EDITOR.damage[from] = 1;
+}
+
+void editorDamageAll(){
+    editorDamageLines(0, EDITOR.screenrows + 1);
+}
+
+// a row changed how it looks
+void editorDamageRow(int filerow){
+    int y = filerow - EDITOR.rowoff;
+    if(y >= 0 && y < EDITOR.screenrows)
+        EDITOR.damage[y] = 1;
+}
+
+// rows from `filerow` down moved
+void editorDamageRowsFrom(int filerow){
+    int y = filerow - EDITOR.rowoff;
+    if(y < EDITOR.screenrows)
+        editorDamageLines(y, EDITOR.screenrows - 1);
+}
+
 /*
  * Syntax Highlighting
  */
@@ -68,537 +564,3236 @@ int is_separator(int c){
         || strchr(",.()+-*/=~%<>[];",c) != NULL;
 }
 
-void editorUpdateSyntax(erow *row){
-    row->highlight = realloc(row->highlight,row->rsize);
-    memset(row->highlight,
-           KILONE_HL_NORMAL,
-           row->rsize);
+unsigned int editorKeywordHash(const char *s, int len){
+    // FNV-1a
+    unsigned int h = 2166136261u;
+    int i;
+    for(i = 0; i < len; i++){
+        h ^= (unsigned char)s[i];
+        h *= 16777619u;
+    }
+    return h;
+}
 
-    if(EDITOR.syntax == NULL) return;
+// builds the lexer tables of a filetype once: a class for every byte,
+// and a keyword hash table so looking up a word costs the same no matter
+// how many keywords the filetype has
+void editorCompileSyntax(struct editorSyntax *syntax){
+    struct editorLexer *lex = calloc(1, sizeof(struct editorLexer));
+    if(lex == NULL) die("calloc");
+    syntax->lexer = lex;
+
+    lex->scs_len = syntax->singleline_comment_start?
+        strlen(syntax->singleline_comment_start):
+        0;
+    lex->mcs_len = syntax->multiline_comment_start?
+        strlen(syntax->multiline_comment_start):
+        0;
+    lex->mce_len = syntax->multiline_comment_end?
+        strlen(syntax->multiline_comment_end):
+        0;
+    // a multiline comment needs both of its ends
+    if(!lex->mcs_len || !lex->mce_len)
+        lex->mcs_len = lex->mce_len = 0;
+
+    int c;
+    for(c = 0; c < 256; c++){
+        if(is_separator(c)) lex->cclass[c] |= KILONE_CC_SEPARATOR;
+        if(isdigit(c)) lex->cclass[c] |= KILONE_CC_DIGIT;
+    }
+    if(lex->scs_len)
+        lex->cclass[(unsigned char)syntax->singleline_comment_start[0]] |= KILONE_CC_SPECIAL;
+    if(lex->mcs_len)
+        lex->cclass[(unsigned char)syntax->multiline_comment_start[0]] |= KILONE_CC_SPECIAL;
+    if(syntax->flags & KILONE_HL_HIGHLIGHT_STRINGS){
+        lex->cclass['"'] |= KILONE_CC_SPECIAL;
+        lex->cclass['\''] |= KILONE_CC_SPECIAL;
+    }
 
-    char **keywords = EDITOR.syntax->keywords;
+    // the vector paths only know about ASCII identifiers and spaces,
+    // so they are only used when those bytes are plain for this filetype
+    lex->simdwords = 1;
+    for(c = 0; c < 256; c++){
+        if((isalnum(c) || c == '_')
+           && (lex->cclass[c] & (KILONE_CC_SEPARATOR | KILONE_CC_SPECIAL)))
+            lex->simdwords = 0;
+    }
+    lex->simdblanks = (lex->cclass[' '] == KILONE_CC_SEPARATOR);
 
-    char *scs = EDITOR.syntax->singleline_comment_start;
-    char *mcs = EDITOR.syntax->multiline_comment_start;
-    char *mce = EDITOR.syntax->multiline_comment_end;
+    int count = 0;
+    while(syntax->keywords[count]) count++;
 
-    int scs_len = scs?
-            strlen(scs):
-            0;
-    int mcs_len = mcs?
-            strlen(mcs):
-            0;
-    int mce_len = mce?
-            strlen(mce):
-            0;
+    unsigned int size = 16;
+    while(size < (unsigned int)count * 2) size *= 2;
 
-    int prev_sep = 1;
-    int in_string = 0;
-    int in_comment = (row->idx > 0 && EDITOR.row[row->idx - 1].hl_open_comment);
+    lex->kwtable = calloc(size, sizeof(struct editorKeyword));
+    if(lex->kwtable == NULL) die("calloc");
+    lex->kwmask = size - 1;
+    lex->kwmaxlen = 0;
 
-    int i = 0;
-    while(i < row->rsize){
-        char c = row->render[i];
-        unsigned char prev_hl = (i > 0)?
-            row->highlight[i - 1]:
-            KILONE_HL_NORMAL;
-
-        // ignore the comment prefix setting if its empty or if were in a string
-        if(scs_len
-           && !in_string
-           && !in_comment){
-            if(!strncmp(&row->render[i], scs, scs_len)){
-                memset(&row->highlight[i],
-                       KILONE_HL_COMMENT,
-                       row->rsize - i);
+    int j;
+    for(j = 0; j < count; j++){
+        char *word = syntax->keywords[j];
+        int len = strlen(word);
+        // types in the keyword list are defined by
+        // adding "|" as the last char
+        int kw2 = word[len - 1] == '|';
+        if(kw2) len--;
+
+        unsigned int h = editorKeywordHash(word, len) & lex->kwmask;
+        while(lex->kwtable[h].word){
+            // the first definition of a word wins
+            if(lex->kwtable[h].len == len
+               && !strncmp(lex->kwtable[h].word, word, len))
                 break;
-            }
+            h = (h + 1) & lex->kwmask;
         }
+        if(lex->kwtable[h].word) continue;
+
+        lex->kwtable[h].word = word;
+        lex->kwtable[h].len = len;
+        lex->kwtable[h].hl = kw2?
+            KILONE_HL_KEYWORD2:
+            KILONE_HL_KEYWORD1;
+        if(len > lex->kwmaxlen) lex->kwmaxlen = len;
+    }
 
-        if(mcs_len
-           && mce_len
-           &&!in_string){
-            if(in_comment){
-                row->highlight[i] = KILONE_HL_MLCOMMENT;
-                if(!strncmp(&row->render[i], mce, mce_len)){
-                    memset(&row->highlight[i],
-                           KILONE_HL_MLCOMMENT,
-                           mcs_len);
-                    i += mce_len;
-                    in_comment = 0;
-                    prev_sep = 1;
-                    continue;
-                } else {
-                    i++;
-                    continue;
-                }
-            } else if (!strncmp(&row->render[i],
-                                mcs,
-                                mcs_len)){
-                memset(&row->highlight[i],
-                       KILONE_HL_MLCOMMENT,
-                       mcs_len);
-                i += mcs_len;
-                in_comment = 1;
-                continue;
-            }
-        }
+    // a failed keyword reads one byte past the longest keyword
+    lex->lookahead = lex->kwmaxlen + 2;
+    if(lex->scs_len > lex->lookahead) lex->lookahead = lex->scs_len;
+    if(lex->mcs_len > lex->lookahead) lex->lookahead = lex->mcs_len;
+}
 
-        if(EDITOR.syntax->flags & KILONE_HL_HIGHLIGHT_STRINGS) {
-            if(in_string) {
-                row->highlight[i] = KILONE_HL_STRING;
+// returns the highlight class of a word, or 0 if it is not a keyword
+unsigned char editorSyntaxKeyword(struct editorLexer *lex, char *s, int len){
+    if(len > lex->kwmaxlen) return 0;
 
-                if(c == '\\' && i + 1 < row->rsize){
-                    row->highlight[i] = KILONE_HL_STRING;
-                    i += 2;
-                    continue;
-                }
-                if(c == in_string) in_string = 0;
-                i++;
-                prev_sep = 1;
-                continue;
-            } else {
-                if(c == '"' || c == '\''){
-                    in_string = c;
-                    row->highlight[i] = KILONE_HL_STRING;
-                    i++;
-                    continue;
-                }
-            }
-        }
+    unsigned int h = editorKeywordHash(s, len) & lex->kwmask;
+    while(lex->kwtable[h].word){
+        if(lex->kwtable[h].len == len
+           && !memcmp(lex->kwtable[h].word, s, len))
+            return lex->kwtable[h].hl;
+        h = (h + 1) & lex->kwmask;
+    }
+    return 0;
+}
 
-        if(EDITOR.syntax->flags & KILONE_HL_HIGHLIGHT_NUMBERS){
-            if((isdigit(c)
-                && (prev_sep
-                    || prev_hl == KILONE_HL_NUMBER))
-            || (c == '.'
-                && prev_hl == KILONE_HL_NUMBER)){
-                row->highlight[i] = KILONE_HL_NUMBER;
-                i++;
-                prev_sep = 0;
-                continue;
-            }
+// skips the rest of a word: bytes that are neither separators nor
+// able to start a comment or string
+int editorLexSkipWord(struct editorLexer *lex, char *text, int i, int len){
+#ifdef __SSE2__
+    if(lex->simdwords){
+        const __m128i case_bit = _mm_set1_epi8(0x20);
+        const __m128i before_a = _mm_set1_epi8('a' - 1);
+        const __m128i after_z = _mm_set1_epi8('z' + 1);
+        const __m128i before_0 = _mm_set1_epi8('0' - 1);
+        const __m128i after_9 = _mm_set1_epi8('9' + 1);
+        const __m128i underscore = _mm_set1_epi8('_');
+        while(i + 16 <= len){
+            __m128i v = _mm_loadu_si128((const __m128i *)&text[i]);
+            __m128i lower = _mm_or_si128(v, case_bit);
+            __m128i alpha = _mm_and_si128(_mm_cmpgt_epi8(lower, before_a),
+                                          _mm_cmplt_epi8(lower, after_z));
+            __m128i digit = _mm_and_si128(_mm_cmpgt_epi8(v, before_0),
+                                          _mm_cmplt_epi8(v, after_9));
+            __m128i word = _mm_or_si128(_mm_or_si128(alpha, digit),
+                                        _mm_cmpeq_epi8(v, underscore));
+            if(_mm_movemask_epi8(word) != 0xffff) break;
+            i += 16;
         }
+    }
+#endif
+    while(i < len
+          && !(lex->cclass[(unsigned char)text[i]]
+               & (KILONE_CC_SEPARATOR | KILONE_CC_SPECIAL)))
+        i++;
+    return i;
+}
 
-        if(prev_sep){
-            int j;
-            for(j = 0; keywords[j]; j++){
-                int klen = strlen(keywords[j]);
-                // check if we want to highlight the character as a type
-                // types in the keyword list are defined by
-                // adding "|" as the last char
-                int kw2 = keywords[j][klen - 1] == '|';
-                if (kw2) klen--;
-
-                if(!strncmp(&row->render[i],
-                            keywords[j],
-                            klen)
-                   && is_separator(row->render[i + klen])){
-                    memset(&row->highlight[i],
-                           kw2?
-                           KILONE_HL_KEYWORD2:
-                           KILONE_HL_KEYWORD1,
-                           klen);
-                    i += klen;
-                    break;
-                }
-
-                if(keywords[j] != NULL) {
-                    prev_sep = 0;
-                    continue;
-                }
-            }
+// skips separators that cannot start anything
+int editorLexSkipBlank(struct editorLexer *lex, char *text, int i, int len){
+#ifdef __SSE2__
+    if(lex->simdblanks){
+        const __m128i space = _mm_set1_epi8(' ');
+        while(i + 16 <= len){
+            __m128i v = _mm_loadu_si128((const __m128i *)&text[i]);
+            if(_mm_movemask_epi8(_mm_cmpeq_epi8(v, space)) != 0xffff) break;
+            i += 16;
         }
-
-        prev_sep = is_separator(c);
-        i++;
     }
+#endif
+    while(i < len
+          && (lex->cclass[(unsigned char)text[i]]
+              & (KILONE_CC_SEPARATOR | KILONE_CC_SPECIAL)) == KILONE_CC_SEPARATOR)
+        i++;
+    return i;
+}
 
-    int changed = (row->hl_open_comment != in_comment);
-    row->hl_open_comment = in_comment;
-    if(changed
-       && row->idx + 1 < EDITOR.numrows)
-        editorUpdateSyntax(&EDITOR.row[row->idx + 1]);
+// returns the offset just past the first `needle` in text[i, len), or -1
+int editorLexFind(char *text, int i, int len, char *needle, int nlen){
+    char *found = memmem(&text[i], len - i, needle, nlen);
+    return found? (found - text) + nlen : -1;
 }
 
+// how a line continues after a byte of the given class: strings and
+// comments end on a separator, numbers and keywords do not
+int editorLexPrevSep(struct editorLexer *lex, unsigned char hl, char c){
+    switch(hl){
+        case KILONE_HL_STRING:
+        case KILONE_HL_MLCOMMENT:
+            return 1;
+        case KILONE_HL_NUMBER:
+        case KILONE_HL_KEYWORD1:
+        case KILONE_HL_KEYWORD2:
+            return 0;
+    }
+    return (lex->cclass[(unsigned char)c] & KILONE_CC_SEPARATOR) != 0;
+}
 
-void editorSelectSyntaxHighlight() {
-    EDITOR.syntax = NULL;
-    if(EDITOR.filename == NULL) return;
+int editorSpanEnd(struct hlSpan *span){
+    return span->start + span->len;
+}
 
-    char *ext = strrchr(EDITOR.filename, '.');
-    for(unsigned int j = 0; j < KILONE_HLDB_ENTRIES; j++){
-        struct editorSyntax *s = &HLDB[j];
-        unsigned int i = 0;
-        while(s->filematch[i]) {
-            int is_ext = (s->filematch[i][0] == '.');
-            if ((is_ext
-                 &&ext
-                 &&!strcmp(ext,s->filematch[i]))
-                || (!is_ext
-                    && strstr(EDITOR.filename,
-                              s->filematch[i]))){
-                    EDITOR.syntax = s;
+// the class of byte `at` in a list of spans, for lookups that only move
+// forward. *cur is the first span that may still cover it
+unsigned char editorSpanClass(struct hlSpan *spans, int n, int *cur, int at){
+    while(*cur < n && editorSpanEnd(&spans[*cur]) <= at) (*cur)++;
+    if(*cur < n && spans[*cur].start <= at) return spans[*cur].hl;
+    return KILONE_HL_NORMAL;
+}
 
-                    int filerow;
-                    for(filerow = 0; filerow < EDITOR.numrows; filerow++){
-                        editorUpdateSyntax(&EDITOR.row[filerow]);
-                    }
+// appends a run of bytes to the spans, growing the last span if the run
+// carries on from it. plain runs are not stored
+void editorLexEmit(struct hlBuffer *out, int start, int len, unsigned char hl){
+    if(out == NULL || hl == KILONE_HL_NORMAL || len <= 0) return;
 
-                    return;
-                }
-                i++;
+    if(out->count){
+        struct hlSpan *last = &out->spans[out->count - 1];
+        if(last->hl == hl && editorSpanEnd(last) == start){
+            last->len += len;
+            return;
         }
     }
+
+    if(out->count == out->cap){
+        out->cap = out->cap? out->cap * 2 : 16;
+        out->spans = realloc(out->spans, out->cap * sizeof(struct hlSpan));
+        if(out->spans == NULL) die("realloc");
+    }
+    struct hlSpan *span = &out->spans[out->count++];
+    span->start = start;
+    span->len = len;
+    span->hl = hl;
 }
 
-/*
- * Row Operations
-*/
-int editorRowCxToRx(erow *row, int cx){
-    int rx = 0;
-    int j;
-    for(j = 0; j < cx; j++){
-        if(row->chars[j] == '\t'){
-            rx += (KILONE_TAB_STOP - 1) - (rx % KILONE_TAB_STOP);
+void editorChunkStale(struct hlChunk *c){
+    slabFree(c->spans);
+    c->spans = NULL;
+    c->hlsize = -1;
+}
+
+// notes restart i, made in state prev_sep, in the chunk it falls in. the
+// chunks passed on the way are left without a restart. returns 1 once i
+// is the restart a chunk past the edit already had
+int editorLexMark(struct lexMarks *m, int i, int prev_sep){
+    struct hlChunks *ch = m->chunks;
+    while(m->k < ch->n && i >= m->start){
+        struct hlChunk *c = &ch->c[m->k];
+        int at = i - m->start;
+        editorChunkStale(c);
+        if(at < c->len
+           && m->k >= m->converge
+           && c->restart == at
+           && c->prev_sep == prev_sep){
+            m->converged = 1;
+            return 1;
         }
-        rx++;
+        c->restart = (at < c->len)? at : -1;
+        c->prev_sep = prev_sep;
+        m->start += c->len;
+        m->k++;
     }
-    return rx;
+    return 0;
 }
 
-int editorRowRxToCx(erow *row, int rx){
-    int cur_rx = 0;
-    int cx;
-    for(cx = 0; cx < row->size; cx++){
-        if(row->chars[cx] == '\t')
-            cur_rx += (KILONE_TAB_STOP - 1) - (cur_rx % KILONE_TAB_STOP);
-        cur_rx++;
-
-        if(cur_rx > rx) return cx;
+// the pass ended without converging, the chunks it never got to have no
+// restart
+void editorLexMarkEnd(struct lexMarks *m){
+    if(m->converged) return;
+    for(; m->k < m->chunks->n; m->k++){
+        editorChunkStale(&m->chunks->c[m->k]);
+        m->chunks->c[m->k].restart = -1;
     }
-    return cx;
 }
 
-void editorUpdateRow(erow *row){
-    int tabs = 0;
-    int j;
-    for(j = 0; j < row->size; j++){
-        if(row->chars[j] == '\t') tabs++;
+// lexes text[i, len) of a line, appending its highlight to `out`. the
+// line is walked span by span: each comment, string, number, keyword or
+// run of plain bytes is classified once and emitted in one go.
+// in_comment is only honoured at i == 0, later restarts are always made
+// outside of comments.
+//
+// if `old` is not NULL, it holds the spans of the line before an edit,
+// moved to where their bytes are now, for everything past `converge`.
+// lexing stops as soon as it reaches a span boundary there in the same
+// state the old line was in, the rest of the old spans are taken over and
+// `converge_end` is returned. otherwise the state the line ends in is
+// returned.
+//
+// `out` may be NULL when only the end state is wanted, and `marks`, if
+// not NULL, gets every restart of a long row noted in its chunks,
+// stopping on a match the same way
+int editorSyntaxLexFrom(char *text, int len, struct hlBuffer *out,
+                        int i, int prev_sep, int in_comment,
+                        struct hlBuffer *old, int converge, int converge_end,
+                        struct lexMarks *marks){
+    if(EDITOR.syntax == NULL) return 0;
+
+    struct editorSyntax *syntax = EDITOR.syntax;
+    struct editorLexer *lex = syntax->lexer;
+    unsigned char *cclass = lex->cclass;
+
+    // the old class of the byte before i, for the convergence check
+    unsigned char old_prev = KILONE_HL_NORMAL;
+    int cur = 0;
+
+    // finish a comment left open by the line above
+    if(i == 0 && in_comment){
+        int end = editorLexFind(text, 0, len,
+                                syntax->multiline_comment_end,
+                                lex->mce_len);
+        if(end == -1){
+            editorLexEmit(out, 0, len, KILONE_HL_MLCOMMENT);
+            return 1;
+        }
+        if(old && end > 0)
+            old_prev = editorSpanClass(old->spans, old->count, &cur, end - 1);
+        editorLexEmit(out, 0, end, KILONE_HL_MLCOMMENT);
+        i = end;
+        prev_sep = 1;
     }
 
+    while(i < len){
+        if(marks && i >= marks->start && editorLexMark(marks, i, prev_sep))
+            return converge_end;
+        if(old
+           && i > converge
+           && editorSpanClass(old->spans, old->count, &cur, i) == KILONE_HL_NORMAL
+           && editorLexPrevSep(lex, old_prev, text[i - 1]) == prev_sep){
+            for(; cur < old->count; cur++)
+                editorLexEmit(out,
+                              old->spans[cur].start,
+                              old->spans[cur].len,
+                              old->spans[cur].hl);
+            return converge_end;
+        }
+
+        unsigned char c = text[i];
+        unsigned char cl = cclass[c];
+        unsigned char span = KILONE_HL_NORMAL;
+        int start = i;
+
+        if(cl & KILONE_CC_SPECIAL){
+            if(lex->scs_len
+               && len - i >= lex->scs_len
+               && !memcmp(&text[i],
+                          syntax->singleline_comment_start,
+                          lex->scs_len)){
+                editorLexEmit(out, i, len - i, KILONE_HL_COMMENT);
+                return 0;
+            }
 
-    free(row->render);
-    row->render = malloc(row->size + tabs*(KILONE_TAB_STOP - 1) + 1);
+            if(lex->mcs_len
+               && len - i >= lex->mcs_len
+               && !memcmp(&text[i],
+                          syntax->multiline_comment_start,
+                          lex->mcs_len)){
+                int end = editorLexFind(text, i + lex->mcs_len, len,
+                                        syntax->multiline_comment_end,
+                                        lex->mce_len);
+                if(end == -1){
+                    editorLexEmit(out, i, len - i, KILONE_HL_MLCOMMENT);
+                    return 1;
+                }
+                i = end;
+                span = KILONE_HL_MLCOMMENT;
+                prev_sep = 1;
+            } else if((syntax->flags & KILONE_HL_HIGHLIGHT_STRINGS)
+                      && (c == '"' || c == '\'')){
+                i++;
+                while(i < len && text[i] != c)
+                    i += (text[i] == '\\' && i + 1 < len)? 2 : 1;
+                if(i < len) i++; // the closing quote
+                span = KILONE_HL_STRING;
+                prev_sep = 1;
+            }
+        }
 
-    int idx = 0;
-    for(j = 0; j < row->size; j++){
-        if(row->chars[j] == '\t'){
-            row->render[idx++] = ' ';
-            while (idx % KILONE_TAB_STOP != 0)
-                row->render[idx++] = ' ';
-        } else{
-            row->render[idx++] = row->chars[j];
+        if(i > start){
+            // a comment or string, already measured
+        } else if((syntax->flags & KILONE_HL_HIGHLIGHT_NUMBERS)
+           && (cl & KILONE_CC_DIGIT)
+           && prev_sep){
+            while(i < len
+                  && ((cclass[(unsigned char)text[i]] & KILONE_CC_DIGIT)
+                      || text[i] == '.'))
+                i++;
+            span = KILONE_HL_NUMBER;
+            prev_sep = 0;
+        } else if(!(cl & (KILONE_CC_SEPARATOR | KILONE_CC_SPECIAL))){
+            span = 0;
+            if(prev_sep){
+                // keywords are whole words, anything longer than the
+                // longest keyword can be given up on early
+                int klen = 0;
+                while(i + klen < len
+                      && klen <= lex->kwmaxlen
+                      && !(cclass[(unsigned char)text[i + klen]] & KILONE_CC_SEPARATOR))
+                    klen++;
+
+                span = editorSyntaxKeyword(lex, &text[i], klen);
+                if(span) i += klen;
+            }
+            if(!span){
+                i = editorLexSkipWord(lex, text, i, len);
+                span = KILONE_HL_NORMAL;
+            }
+            prev_sep = 0;
+        } else if(cl == KILONE_CC_SEPARATOR){
+            i = editorLexSkipBlank(lex, text, i, len);
+            prev_sep = 1;
+        } else {
+            // a special byte that did not start anything after all
+            i++;
+            prev_sep = (cl & KILONE_CC_SEPARATOR) != 0;
         }
+
+        if(old) old_prev = editorSpanClass(old->spans, old->count, &cur, i - 1);
+        editorLexEmit(out, start, i - start, span);
     }
-    row->render[idx] = '\0';
-    row->rsize = idx;
 
-    editorUpdateSyntax(row);
+    return 0;
 }
 
+int editorSyntaxLex(char *text, int len, struct hlBuffer *out, int in_comment){
+    if(out) out->count = 0;
+    return editorSyntaxLexFrom(text, len, out, 0, 1, in_comment, NULL, -1, 0, NULL);
+}
 
-void editorInsertRow(int at,char* s, size_t len){
-    if(at < 0 || at > EDITOR.numrows)
-        return;
-
-    EDITOR.row = realloc(EDITOR.row,
-                         sizeof(erow) * (EDITOR.numrows + 1));
-    memmove(&EDITOR.row[at + 1],
-            &EDITOR.row[at],
-            sizeof(erow) * (EDITOR.numrows - at));
-    for(int j = at + 1; j <= EDITOR.numrows; j++) EDITOR.row[j].idx++;
+// re-lexes a line whose bytes [at, at + removed) were just replaced by
+// `added` new ones. old holds the spans of the line before the edit,
+// the new ones go to `out`. lexing picks up from the last plain byte
+// before the edit that no lookahead can have carried the edit back to,
+// and stops once it is in step with the old spans again. returns the
+// state the line ends in
+int editorSyntaxRelex(char *text, int len, struct hlBuffer *old,
+                      struct hlBuffer *out, int in_comment,
+                      int at, int removed, int added, int old_end){
+    static struct hlBuffer tail;
+    struct hlSpan *hl = old->spans;
+    int n = old->count;
+
+    out->count = 0;
+    if(EDITOR.syntax == NULL) return 0;
+
+    struct editorLexer *lex = EDITOR.syntax->lexer;
+    int from = at - lex->lookahead;
+    int k = n - 1;
+    while(from > 0){
+        while(k >= 0 && hl[k].start > from) k--;
+        if(k < 0 || editorSpanEnd(&hl[k]) <= from) break;
+        from = hl[k].start - 1;
+    }
 
-    EDITOR.row[at].idx = at;
+    // the old spans past the edit, moved along with their bytes
+    tail.count = 0;
+    int j;
+    for(j = 0; j < n; j++){
+        int start = hl[j].start;
+        int end = editorSpanEnd(&hl[j]);
+        if(end <= at + removed) continue;
+        if(start < at + removed) start = at + removed;
+        editorLexEmit(&tail,
+                      start - removed + added,
+                      end - start,
+                      hl[j].hl);
+    }
 
-    EDITOR.row[at].size = len;
-    EDITOR.row[at].chars = malloc(len + 1);
-    memcpy(EDITOR.row[at].chars,
-           s,
-           len);
-    EDITOR.row[at].chars[len] = '\0';
+    if(from <= 0)
+        return editorSyntaxLexFrom(text, len, out, 0, 1, in_comment,
+                                   &tail, at + added, old_end, NULL);
+
+    // the spans before `from` stay as they are
+    for(j = 0; j <= k; j++)
+        editorLexEmit(out, hl[j].start, hl[j].len, hl[j].hl);
+    unsigned char prev = (k >= 0 && editorSpanEnd(&hl[k]) == from)?
+        hl[k].hl :
+        KILONE_HL_NORMAL;
+    return editorSyntaxLexFrom(text, len, out, from,
+                               editorLexPrevSep(lex, prev, text[from - 1]),
+                               0, &tail, at + added, old_end, NULL);
+}
 
-    EDITOR.row[at].rsize = 0;
-    EDITOR.row[at].render = NULL;
-    EDITOR.row[at].highlight = NULL;
-    EDITOR.row[at].hl_open_comment = 0;
-    editorUpdateRow(&EDITOR.row[at]);
+// a row's spans are packed as the gap since the end of the previous span
+// and the length, both as base 128 varints, followed by the class byte.
+// most rows need a few bytes at most, short enough to live in the row
 
-    EDITOR.numrows++;
-    EDITOR.dirty++;
+int editorVarintPut(unsigned char *p, unsigned int v){
+    int n = 0;
+    while(v >= 0x80){
+        p[n++] = v | 0x80;
+        v >>= 7;
+    }
+    p[n++] = v;
+    return n;
 }
 
-void editorFreeRow(erow *row){
-    free(row->render);
-    free(row->chars);
-    free(row->highlight);
+int editorVarintGet(unsigned char *p, int *v){
+    unsigned int x = 0;
+    int n = 0, shift = 0;
+    do {
+        x |= (unsigned int)(p[n] & 0x7f) << shift;
+        shift += 7;
+    } while(p[n++] & 0x80);
+    *v = x;
+    return n;
 }
 
-void editorDelRow(int at){
-    if(at < 0 || at >= EDITOR.numrows) return;
-    editorFreeRow(&EDITOR.row[at]);
-    memmove(&EDITOR.row[at],
-            &EDITOR.row[at + 1],
-            sizeof(erow) * (EDITOR.numrows - at - 1));
-    for(int j = at; j < EDITOR.numrows; j++)
-        EDITOR.row[j].idx++;
-    EDITOR.numrows--;
-    EDITOR.dirty++;
+unsigned char *editorRowSpans(erow *row){
+    return row->hlsize <= (int)sizeof(row->highlight)?
+        row->highlight.bytes :
+        row->highlight.ptr;
 }
 
-void editorRowInsertChar(erow *row,int at, int c){
-    if(at < 0 || at > row->size) at = row->size;
-    row->chars = realloc(row->chars,
-                         row->size + 2);
+// packs spans into a buffer that stays valid until the next call.
+// returns its size
+int editorSpansPack(struct hlBuffer *spans, unsigned char **packed){
+    static unsigned char *buf = NULL;
+    static int cap = 0;
+
+    // a gap, a length and a class take 11 bytes at worst
+    if(spans->count * 11 > cap){
+        cap = spans->count * 11;
+        buf = realloc(buf, cap);
+        if(buf == NULL) die("realloc");
+    }
+
+    int size = 0, end = 0, j;
+    for(j = 0; j < spans->count; j++){
+        struct hlSpan *span = &spans->spans[j];
+        size += editorVarintPut(&buf[size], span->start - end);
+        size += editorVarintPut(&buf[size], span->len);
+        buf[size++] = span->hl;
+        end = editorSpanEnd(span);
+    }
+    *packed = buf;
+    return size;
+}
+
+// appends packed spans to `spans`, moved by `base`
+void editorSpansUnpack(unsigned char *p, int size, int base,
+                       struct hlBuffer *spans){
+    int i = 0, end = base;
+    while(i < size){
+        int gap, len;
+        i += editorVarintGet(&p[i], &gap);
+        i += editorVarintGet(&p[i], &len);
+        editorLexEmit(spans, end + gap, len, p[i++]);
+        end += gap + len;
+    }
+}
+
+void editorRowFreeHighlight(erow *row){
+    if(row->hlsize < 0){
+        struct hlChunks *ch = row->highlight.chunks;
+        int k;
+        for(k = 0; k < ch->n; k++) slabFree(ch->c[k].spans);
+        slabFree(ch);
+    } else if(row->hlsize > (int)sizeof(row->highlight)){
+        slabFree(row->highlight.ptr);
+    }
+    row->hlsize = 0;
+}
+
+// stores freshly lexed spans as the highlight of a row
+void editorRowSetHighlight(erow *row, struct hlBuffer *spans){
+    unsigned char *packed;
+    int size = editorSpansPack(spans, &packed);
+
+    if(row->hlsize < 0) editorRowFreeHighlight(row);
+
+    // keep the old block unless it is too small or far too big
+    int inline_size = sizeof(row->highlight);
+    int cap = (row->hlsize > inline_size)?
+        (int)slabCap(row->highlight.ptr) :
+        inline_size;
+    if(size > cap || (cap > inline_size && size * 2 <= cap)){
+        if(row->hlsize > inline_size) slabFree(row->highlight.ptr);
+        if(size > inline_size) row->highlight.ptr = slabAlloc(size);
+    }
+    row->hlsize = size;
+    if(size)
+        memcpy(editorRowSpans(row),
+               packed,
+               size);
+}
+
+// A row of KILONE_LONG_ROW bytes or more keeps its highlight as a chain
+// of chunks of about KILONE_HL_CHUNK bytes. a full pass over the row only
+// notes where the lexer can restart in each chunk and the state it ends
+// in, the spans of a chunk are lexed once it is drawn. an edit re-lexes
+// from the last restart before it until a chunk past it restarts as
+// before, and only forgets the spans of the chunks it went through. rows
+// stay chunked until they shrink to half the threshold.
+
+int editorRowIsLong(erow *row){
+    int threshold = (row->hlsize < 0)? KILONE_LONG_ROW / 2 : KILONE_LONG_ROW;
+    return row->size >= threshold;
+}
+
+struct hlChunks *editorChunksNew(int size){
+    int n = (size + KILONE_HL_CHUNK - 1) / KILONE_HL_CHUNK;
+    if(n == 0) n = 1;
+
+    struct hlChunks *ch = slabAlloc(sizeof(struct hlChunks) +
+                                    n * sizeof(struct hlChunk));
+    ch->n = n;
+    ch->cap = n;
+    int k;
+    for(k = 0; k < n; k++){
+        struct hlChunk *c = &ch->c[k];
+        c->len = (size > KILONE_HL_CHUNK)? KILONE_HL_CHUNK : size;
+        c->restart = -1;
+        c->prev_sep = 0;
+        c->hlsize = -1;
+        c->spans = NULL;
+        size -= c->len;
+    }
+    return ch;
+}
+
+// lexes a long row from its start, noting the restarts of fresh chunks.
+// returns the state it ends in
+int editorRowLexChunks(erow *row){
+    editorRowFreeHighlight(row);
+    struct hlChunks *ch = editorChunksNew(row->size);
+    row->highlight.chunks = ch;
+    row->hlsize = -1;
+
+    struct lexMarks m = {ch, 0, 0, ch->n, 0};
+    int end = editorSyntaxLexFrom(row->chars, row->size, NULL, 0, 1,
+                                  row->hl_start, NULL, -1, 0, &m);
+    editorLexMarkEnd(&m);
+    return end;
+}
+
+// removes the chunks in [from, to) that were emptied by an edit, leaving
+// at least one
+void editorChunksDropEmpty(struct hlChunks *ch, int from, int to){
+    int k, n = from;
+    for(k = from; k < ch->n; k++){
+        if(k < to && ch->c[k].len == 0 && ch->n - (k - n) > 1){
+            editorChunkStale(&ch->c[k]);
+            continue;
+        }
+        ch->c[n++] = ch->c[k];
+    }
+    ch->n = n;
+}
+
+// splits chunk k into pieces of KILONE_HL_CHUNK bytes
+void editorChunksSplit(erow *row, int k){
+    struct hlChunks *ch = row->highlight.chunks;
+    int pieces = (ch->c[k].len + KILONE_HL_CHUNK - 1) / KILONE_HL_CHUNK;
+    int extra = pieces - 1;
+
+    if(ch->n + extra > ch->cap){
+        int cap = ch->cap * 2;
+        if(cap < ch->n + extra) cap = ch->n + extra;
+        ch = slabRealloc(ch, sizeof(struct hlChunks) +
+                             cap * sizeof(struct hlChunk));
+        ch->cap = cap;
+        row->highlight.chunks = ch;
+    }
+    memmove(&ch->c[k + pieces],
+            &ch->c[k + 1],
+            (ch->n - k - 1) * sizeof(struct hlChunk));
+    ch->n += extra;
+
+    int len = ch->c[k].len - KILONE_HL_CHUNK, j;
+    ch->c[k].len = KILONE_HL_CHUNK;
+    if(ch->c[k].restart >= KILONE_HL_CHUNK) ch->c[k].restart = -1;
+    for(j = k + 1; j <= k + extra; j++){
+        struct hlChunk *c = &ch->c[j];
+        c->len = (len > KILONE_HL_CHUNK)? KILONE_HL_CHUNK : len;
+        c->restart = -1;
+        c->hlsize = -1;
+        c->spans = NULL;
+        len -= c->len;
+    }
+}
+
+// moves the chunks of a long row along with chars[at, at + removed)
+// being replaced by `added` bytes. the restarts the edit may have moved
+// are forgotten
+void editorChunksEdit(erow *row, int at, int removed, int added){
+    struct hlChunks *ch = row->highlight.chunks;
+    int k = 0, start = 0;
+
+    // the chunk `at` falls in, or the last one at the end of the row
+    while(k < ch->n - 1 && start + ch->c[k].len <= at){
+        start += ch->c[k].len;
+        k++;
+    }
+
+    int j = k, off = at - start, left = removed;
+    do {
+        struct hlChunk *c = &ch->c[j];
+        int cut = c->len - off;
+        if(cut > left) cut = left;
+        c->len -= cut;
+        left -= cut;
+        if(c->restart >= off) c->restart = -1;
+        editorChunkStale(c);
+        off = 0;
+        j++;
+    } while(left > 0 && j < ch->n);
+
+    ch->c[k].len += added;
+    editorChunksDropEmpty(ch, k + 1, j);
+    if(ch->c[k].len == 0) editorChunksDropEmpty(ch, k, k + 1);
+    else if(ch->c[k].len > 2 * KILONE_HL_CHUNK) editorChunksSplit(row, k);
+}
+
+// re-lexes a long row after an edit, from the last restart no lookahead
+// can have carried the edit back to. returns the state the row ends in
+int editorRowRelexChunks(erow *row, int at, int removed, int added){
+    editorChunksEdit(row, at, removed, added);
+
+    struct hlChunks *ch = row->highlight.chunks;
+    int lookahead = EDITOR.syntax? EDITOR.syntax->lexer->lookahead : 0;
+    struct lexMarks m = {ch, 0, 0, ch->n, 0};
+    int k, start = 0, from = 0, prev_sep = 1;
+
+    for(k = 0; k < ch->n; k++){
+        struct hlChunk *c = &ch->c[k];
+        if(start >= at + added){
+            m.converge = k;
+            break;
+        }
+        if(c->restart >= 0 && start + c->restart <= at - lookahead){
+            m.k = k;
+            m.start = start;
+            from = start + c->restart;
+            prev_sep = c->prev_sep;
+        }
+        start += c->len;
+    }
+
+    int end = editorSyntaxLexFrom(row->chars, row->size, NULL,
+                                  from, prev_sep, from? 0 : row->hl_start,
+                                  NULL, -1, row->hl_open_comment, &m);
+    editorLexMarkEnd(&m);
+    return end;
+}
+
+// lexes the spans of chunk k, which starts at `start`, from the closest
+// restart at or before it
+void editorChunkHighlight(erow *row, int k, int start){
+    static struct hlBuffer spans, clipped;
+    struct hlChunks *ch = row->highlight.chunks;
+    struct hlChunk *c = &ch->c[k];
+    if(c->hlsize >= 0) return;
+
+    int from = 0, prev_sep = 1, j, pos = start;
+    for(j = k; j >= 0; j--){
+        if(ch->c[j].restart >= 0 && pos + ch->c[j].restart <= start){
+            from = pos + ch->c[j].restart;
+            prev_sep = ch->c[j].prev_sep;
+            break;
+        }
+        if(j > 0) pos -= ch->c[j - 1].len;
+    }
+
+    int end = start + c->len;
+    int len = end + (EDITOR.syntax? EDITOR.syntax->lexer->lookahead : 0);
+    if(len > row->size) len = row->size;
+    spans.count = 0;
+    editorSyntaxLexFrom(row->chars, len, &spans, from, prev_sep,
+                        from? 0 : row->hl_start == 1, NULL, -1, 0, NULL);
+
+    // keep what falls in the chunk, counted from its start
+    clipped.count = 0;
+    for(j = 0; j < spans.count; j++){
+        int s0 = spans.spans[j].start;
+        int s1 = editorSpanEnd(&spans.spans[j]);
+        if(s0 < start) s0 = start;
+        if(s1 > end) s1 = end;
+        editorLexEmit(&clipped, s0 - start, s1 - s0, spans.spans[j].hl);
+    }
+
+    unsigned char *packed;
+    c->hlsize = editorSpansPack(&clipped, &packed);
+    if(c->hlsize){
+        c->spans = slabAlloc(c->hlsize);
+        memcpy(c->spans, packed, c->hlsize);
+    }
+}
+
+// unpacks the spans of a row covering chars[from, to). of a long row
+// only the chunks in that range are highlighted, other rows come whole
+void editorRowGetHighlight(erow *row, int from, int to,
+                           struct hlBuffer *spans){
+    spans->count = 0;
+    if(row->hlsize >= 0){
+        editorSpansUnpack(editorRowSpans(row), row->hlsize, 0, spans);
+        return;
+    }
+
+    struct hlChunks *ch = row->highlight.chunks;
+    int k, start = 0;
+    for(k = 0; k < ch->n && start < to; k++){
+        int end = start + ch->c[k].len;
+        if(end > from){
+            editorChunkHighlight(row, k, start);
+            editorSpansUnpack(ch->c[k].spans, ch->c[k].hlsize, start, spans);
+        }
+        start = end;
+    }
+}
+
+// lexes a row from the state the previous row ended in. rows that were
+// never drawn only get their end state worked out
+void editorUpdateSyntax(int filerow){
+    static struct hlBuffer spans;
+
+    erow *row = editorRowAt(filerow);
+    int in_comment = (filerow > 0 && editorRowAt(filerow - 1)->hl_open_comment);
+
+    row->hl_start = in_comment;
+    if(row->ready && editorRowIsLong(row)){
+        editorDamageRow(filerow);
+        row->hl_open_comment = editorRowLexChunks(row);
+        return;
+    }
+    row->hl_open_comment = editorSyntaxLex(row->chars,
+                                           row->size,
+                                           row->ready? &spans : NULL,
+                                           in_comment);
+    if(row->ready){
+        editorDamageRow(filerow);
+        editorRowSetHighlight(row, &spans);
+    }
+}
+
+// Every row caches the state it was lexed from (hl_start) next to the
+// one it ends in (hl_open_comment). rows before EDITOR.hl_clean are known
+// to agree with the row above them, everything after is checked lazily
+// right before it is drawn.
+
+// lexes forward from the first unchecked row up to `upto`. a row whose
+// cached start state still holds needs no lexing, and if it sits inside
+// the region an earlier cascade cut off, that whole region is good again
+void editorSyntaxValidate(int upto){
+    if(upto >= EDITOR.numrows) upto = EDITOR.numrows - 1;
+
+    while(EDITOR.hl_clean <= upto){
+        int filerow = EDITOR.hl_clean;
+        int start = (filerow > 0 && editorRowAt(filerow - 1)->hl_open_comment);
+
+        if(editorRowAt(filerow)->hl_start == start){
+            EDITOR.hl_clean = (filerow < EDITOR.hl_resume)?
+                EDITOR.hl_resume :
+                filerow + 1;
+        } else {
+            editorUpdateSyntax(filerow);
+            EDITOR.hl_clean = filerow + 1;
+        }
+    }
+}
+
+// the row before `filerow` was just re-lexed. if `filerow` no longer starts
+// in the state it was lexed from, everything from it on is unchecked
+void editorSyntaxCascade(int filerow){
+    if(filerow >= EDITOR.hl_clean) return;
+
+    int start = (filerow > 0 && editorRowAt(filerow - 1)->hl_open_comment);
+    if(editorRowAt(filerow)->hl_start == start) return;
+
+    EDITOR.hl_resume = EDITOR.hl_clean;
+    EDITOR.hl_clean = filerow;
+}
+
+void editorSyntaxRowChanged(int filerow){
+    if(filerow >= EDITOR.hl_clean){
+        editorRowAt(filerow)->hl_start = -1;
+        if(filerow < EDITOR.hl_resume)
+            EDITOR.hl_resume = filerow;
+        return;
+    }
+
+    editorUpdateSyntax(filerow);
+    editorSyntaxCascade(filerow + 1);
+}
+
+// chars[at, at + removed) of a row were replaced with `added` new bytes.
+// the highlight is re-lexed around the edit, if it was up to date to
+// begin with
+void editorSyntaxRowPatched(int filerow, int at, int removed, int added){
+    static struct hlBuffer old, spans;
+
+    if(filerow >= EDITOR.hl_clean){
+        editorSyntaxRowChanged(filerow);
+        return;
+    }
+
+    erow *row = editorRowAt(filerow);
+    if(row->hlsize < 0 || editorRowIsLong(row)){
+        if(row->hlsize < 0 && editorRowIsLong(row))
+            row->hl_open_comment = editorRowRelexChunks(row, at, removed, added);
+        else
+            editorUpdateSyntax(filerow);
+        editorSyntaxCascade(filerow + 1);
+        return;
+    }
+    editorRowGetHighlight(row, 0, row->size, &old);
+    row->hl_open_comment = editorSyntaxRelex(row->chars,
+                                             row->size,
+                                             &old,
+                                             &spans,
+                                             row->hl_start,
+                                             at,
+                                             removed,
+                                             added,
+                                             row->hl_open_comment);
+    editorRowSetHighlight(row, &spans);
+    editorSyntaxCascade(filerow + 1);
+}
+
+void editorSyntaxRowInserted(int filerow){
+    if(filerow < EDITOR.hl_clean) EDITOR.hl_clean++;
+    if(filerow < EDITOR.hl_resume) EDITOR.hl_resume++;
+    editorSyntaxRowChanged(filerow);
+}
+
+void editorSyntaxRowDeleted(int filerow){
+    if(filerow < EDITOR.hl_clean){
+        EDITOR.hl_clean--;
+        if(filerow < EDITOR.hl_resume) EDITOR.hl_resume--;
+        editorSyntaxCascade(filerow);
+    } else if(filerow < EDITOR.hl_resume){
+        EDITOR.hl_resume = filerow;
+    }
+}
+
+// rows from `filerow` on were inserted or deleted in bulk, they are
+// checked again from there once they are drawn
+void editorSyntaxRowsMoved(int filerow){
+    if(filerow < EDITOR.hl_clean) EDITOR.hl_clean = filerow;
+    if(filerow < EDITOR.hl_resume) EDITOR.hl_resume = filerow;
+}
+
+// forget every cached lexer state, for when the filetype changes
+void editorSyntaxReset(){
+    int filerow;
+    for(filerow = 0; filerow < EDITOR.numrows; filerow++)
+        editorRowAt(filerow)->hl_start = -1;
+    EDITOR.hl_clean = 0;
+    EDITOR.hl_resume = 0;
+    editorDamageAll();
+}
+
+void editorSelectSyntaxHighlight() {
+    EDITOR.syntax = NULL;
+    editorSyntaxReset();
+    if(EDITOR.filename == NULL) return;
+
+    char *ext = strrchr(EDITOR.filename, '.');
+    for(unsigned int j = 0; j < KILONE_HLDB_ENTRIES; j++){
+        struct editorSyntax *s = &HLDB[j];
+        unsigned int i = 0;
+        while(s->filematch[i]) {
+            int is_ext = (s->filematch[i][0] == '.');
+            if ((is_ext
+                 &&ext
+                 &&!strcmp(ext,s->filematch[i]))
+                || (!is_ext
+                    && strstr(EDITOR.filename,
+                              s->filematch[i]))){
+                    EDITOR.syntax = s;
+                    return;
+                }
+                i++;
+        }
+    }
+}
+
+/*
+ * Undo
+ */
+
+// edits are recorded by the row operations below. a step is what one
+// undo takes back: a run of typing, a deleted line, a paste
+
+long undoRecordSize(int len){
+    return (sizeof(struct undoRecord) + len + 7) & ~7L;
+}
+
+struct undoRecord *undoRecordAt(struct undoBlock *b, long off){
+    return (struct undoRecord *)&b->data[off];
+}
+
+void editorUndoFreeBlocks(struct undoBlock *b){
+    while(b){
+        struct undoBlock *next = b->next;
+        EDITOR.undo.size -= b->cap;
+        free(b);
+        b = next;
+    }
+}
+
+// forgets all history
+void editorUndoClear(){
+    struct editorUndo *u = &EDITOR.undo;
+    editorUndoFreeBlocks(u->first);
+    u->first = u->last = u->top = NULL;
+    u->top_off = 0;
+    u->sealed = 1;
+}
+
+// the record before the one at (*b, *off), moving the position onto it
+struct undoRecord *editorUndoPrev(struct undoBlock **b, long *off){
+    while(*b){
+        long rec = *off == (*b)->used?
+                   (*b)->last :
+                   undoRecordAt(*b, *off)->prev;
+        if(rec >= (*b)->start && rec != -1){
+            *off = rec;
+            return undoRecordAt(*b, rec);
+        }
+        if((*b)->prev == NULL) return NULL;
+        *b = (*b)->prev;
+        *off = (*b)->used;
+    }
+    return NULL;
+}
+
+// the record at (*b, *off), moving the position past it
+struct undoRecord *editorUndoNext(struct undoBlock **b, long *off){
+    while(*b){
+        if(*off < (*b)->used){
+            struct undoRecord *r = undoRecordAt(*b, *off);
+            *off += undoRecordSize(r->len);
+            return r;
+        }
+        if((*b)->next == NULL) return NULL;
+        *b = (*b)->next;
+        *off = 0;
+    }
+    return NULL;
+}
+
+// drops the oldest blocks until the history fits its cap again. a step
+// cut in half would undo partially, so the rest of it goes too
+void editorUndoTrim(){
+    struct editorUndo *u = &EDITOR.undo;
+    while(u->size > KILONE_UNDO_MAX && u->first != u->top){
+        struct undoBlock *b = u->first;
+        u->first = b->next;
+        u->first->prev = NULL;
+        u->size -= b->cap;
+        free(b);
+
+        b = u->first;
+        long off = b->start;
+        while(off < b->used && !undoRecordAt(b, off)->group)
+            off += undoRecordSize(undoRecordAt(b, off)->len);
+        b->start = off;
+    }
+}
+
+// room for `len` more bytes of text in the record before the top
+char *editorUndoGrow(struct undoRecord *r, int len){
+    struct undoBlock *b = EDITOR.undo.top;
+    long off = (char *)r - b->data;
+    if(off + undoRecordSize(r->len + len) > b->cap) return NULL;
+    b->used = off + undoRecordSize(r->len + len);
+    EDITOR.undo.top_off = b->used;
+    char *text = (char *)(r + 1) + r->len;
+    r->len += len;
+    return text;
+}
+
+// an edit that can be added onto the last record, returns where its
+// text goes or NULL if it needs a record of its own
+char *editorUndoCoalesce(int op, int row, int col, int len){
+    struct editorUndo *u = &EDITOR.undo;
+    if(u->sealed || u->depth || u->top == NULL) return NULL;
+    if(u->top_off != u->top->used || u->top->last < u->top->start)
+        return NULL;
+    struct undoRecord *r = undoRecordAt(u->top, u->top->last);
+    if(r->op != op || (op <= UNDO_DELETE_TEXT && r->row != row))
+        return NULL;
+
+    char *text;
+    switch(op){
+        case UNDO_INSERT_TEXT:
+            if(r->col + r->len != col) return NULL;
+            return editorUndoGrow(r, len);
+        case UNDO_INSERT_ROWS:
+            if(r->row + r->col != row) return NULL;
+            if((text = editorUndoGrow(r, len))) r->col += col;
+            return text;
+        case UNDO_DELETE_TEXT:
+            // forward deletes pile up behind, backspaces in front
+            if(r->col == col) return editorUndoGrow(r, len);
+            if(col + len != r->col) return NULL;
+            break;
+        case UNDO_DELETE_ROWS:
+            if(r->row == row){
+                if((text = editorUndoGrow(r, len))) r->col += col;
+                return text;
+            }
+            if(row + col != r->row) return NULL;
+            break;
+    }
+    if(editorUndoGrow(r, len) == NULL) return NULL;
+    text = (char *)(r + 1);
+    memmove(text + len, text, r->len - len);
+    if(op == UNDO_DELETE_TEXT){
+        r->col = col;
+    } else {
+        r->row = row;
+        r->col += col;
+    }
+    return text;
+}
+
+// records an edit and returns where its `len` bytes of text go, or NULL
+// while edits aren't recorded
+char *editorUndoPush(int op, int row, int col, int len){
+    struct editorUndo *u = &EDITOR.undo;
+    if(u->suspend) return NULL;
+
+    // whatever was undone can't be redone after a new edit
+    if(u->top){
+        editorUndoFreeBlocks(u->top->next);
+        u->top->next = NULL;
+        u->last = u->top;
+        if(u->top_off < u->top->used){
+            u->top->last = undoRecordAt(u->top, u->top_off)->prev;
+            u->top->used = u->top_off;
+        }
+    }
+
+    char *text = editorUndoCoalesce(op, row, col, len);
+    if(text) return text;
+
+    long size = undoRecordSize(len);
+    if(size > KILONE_UNDO_MAX){
+        // too big to ever keep, and older steps wouldn't apply anymore
+        editorUndoClear();
+        return NULL;
+    }
+    struct undoBlock *b = u->top;
+    if(b == NULL || b->cap - b->used < size){
+        long cap = size > KILONE_UNDO_BLOCK? size : KILONE_UNDO_BLOCK;
+        struct undoBlock *n = malloc(sizeof(struct undoBlock) + cap);
+        if(n == NULL) die("malloc");
+        n->prev = b;
+        n->next = NULL;
+        n->used = 0;
+        n->cap = cap;
+        n->last = -1;
+        n->start = 0;
+        if(b) b->next = n;
+        else u->first = n;
+        u->last = u->top = b = n;
+        u->size += cap;
+    }
+
+    struct undoRecord *r = undoRecordAt(b, b->used);
+    r->op = op;
+    r->group = u->sealed || u->depth == 0;
+    r->row = row;
+    r->col = col;
+    r->len = len;
+    r->cx = u->depth? u->cx : EDITOR.cx;
+    r->cy = u->depth? u->cy : EDITOR.cy;
+    r->prev = b->last;
+    b->last = b->used;
+    b->used += size;
+    u->top_off = b->used;
+    u->sealed = 0;
+
+    editorUndoTrim();
+    return (char *)(r + 1);
+}
+
+// the edits up to the matching editorUndoEnd are undone as one step
+void editorUndoBegin(){
+    struct editorUndo *u = &EDITOR.undo;
+    if(u->depth++ == 0){
+        u->sealed = 1;
+        u->cx = EDITOR.cx;
+        u->cy = EDITOR.cy;
+    }
+}
+
+void editorUndoEnd(){
+    if(--EDITOR.undo.depth == 0)
+        EDITOR.undo.sealed = 1;
+}
+
+// keeps the next edit from being merged into the previous step
+void editorUndoBreak(){
+    EDITOR.undo.sealed = 1;
+}
+
+/*
+ * Row Operations
+*/
+// the column just past byte `c` drawn at column rx
+int editorColumnAfter(char c, int rx){
+    if(c == '\t')
+        rx += (KILONE_TAB_STOP - 1) - (rx % KILONE_TAB_STOP);
+    return rx + 1;
+}
+
+// extends the column checkpoints of a row up to checkpoint k, which must
+// lie within the row, and returns them
+struct rxIndex *editorRowIndex(erow *row, int k){
+    struct rxIndex *ix = row->rxindex;
+    if(ix == NULL || k >= ix->cap){
+        int cap = row->size / KILONE_RX_STEP + 1;
+        ix = slabRealloc(ix, sizeof(struct rxIndex) + cap * sizeof(int));
+        if(row->rxindex == NULL){
+            ix->n = 1;
+            ix->rx[0] = 0;
+        }
+        ix->cap = cap;
+        row->rxindex = ix;
+    }
+
+    while(ix->n <= k){
+        int j = (ix->n - 1) * KILONE_RX_STEP;
+        int end = j + KILONE_RX_STEP;
+        int rx = ix->rx[ix->n - 1];
+        for(; j < end; j++)
+            rx = editorColumnAfter(row->chars[j], rx);
+        ix->rx[ix->n++] = rx;
+    }
+    return ix;
+}
+
+// an edit at chars[at] leaves the checkpoints up to `at` as they are
+void editorRowIndexCut(erow *row, int at){
+    if(row->rxindex && row->rxindex->n > at / KILONE_RX_STEP + 1)
+        row->rxindex->n = at / KILONE_RX_STEP + 1;
+}
+
+int editorRowCxToRx(erow *row, int cx){
+    int rx = 0;
+    int j = 0;
+    if(cx >= KILONE_RX_STEP){
+        int k = cx / KILONE_RX_STEP;
+        rx = editorRowIndex(row, k)->rx[k];
+        j = k * KILONE_RX_STEP;
+    }
+    for(; j < cx; j++)
+        rx = editorColumnAfter(row->chars[j], rx);
+    return rx;
+}
+
+// returns the byte drawn over screen column rx, or size if the row ends
+// before it. if `start` is not NULL it gets the column that byte starts at
+int editorRowRxToCx(erow *row, int rx, int *start){
+    int cur_rx = 0;
+    int cx = 0;
+    if(row->size >= KILONE_RX_STEP){
+        // the last checkpoint at or left of rx, built as far as needed
+        int last = row->size / KILONE_RX_STEP;
+        struct rxIndex *ix = editorRowIndex(row, 0);
+        while(ix->n <= last && ix->rx[ix->n - 1] <= rx)
+            ix = editorRowIndex(row, ix->n);
+
+        int lo = 0, hi = ix->n - 1;
+        while(lo < hi){
+            int mid = (lo + hi + 1) / 2;
+            if(ix->rx[mid] <= rx) lo = mid;
+            else hi = mid - 1;
+        }
+        cx = lo * KILONE_RX_STEP;
+        cur_rx = ix->rx[lo];
+    }
+
+    for(; cx < row->size; cx++){
+        int next = editorColumnAfter(row->chars[cx], cur_rx);
+        if(next > rx) break;
+        cur_rx = next;
+    }
+    if(start) *start = cur_rx;
+    return cx;
+}
+
+void editorUpdateRow(int filerow){
+    editorRowAt(filerow)->ready = 1;
+    editorDamageRow(filerow);
+    editorSyntaxRowChanged(filerow);
+}
+
+// re-lexes only the part of a drawn row around an edit that replaced
+// chars[at, at + removed) with `added` new bytes. returns 0 if the row
+// has to be updated the slow way
+int editorRowPatch(int filerow, int at, int removed, int added){
+    erow *row = editorRowAt(filerow);
+    editorRowIndexCut(row, at);
+    if(!row->ready) return 0;
+
+    editorSyntaxRowPatched(filerow, at, removed, added);
+    editorDamageRow(filerow);
+    return 1;
+}
+
+// gets a row ready to be drawn: highlighted from a lexer state that is
+// known to be right, and kept highlighted from then on
+void editorPrepareRow(int filerow){
+    editorSyntaxValidate(filerow - 1);
+
+    erow *row = editorRowAt(filerow);
+    if(!row->ready){
+        row->ready = 1;
+        if(filerow < EDITOR.hl_clean)
+            editorUpdateSyntax(filerow);
+        else
+            row->hl_start = -1;
+    }
+    editorSyntaxValidate(filerow);
+}
+
+
+void editorInsertRow(int at,char* s, size_t len){
+    if(at < 0 || at > EDITOR.numrows)
+        return;
+
+    char *undo = editorUndoPush(UNDO_INSERT_ROWS, at, 1, len + 1);
+    if(undo){
+        memcpy(undo, s, len);
+        undo[len] = '\n';
+    }
+
+    char *chars = slabAlloc(len + 1);
+    memcpy(chars,
+           s,
+           len);
+    chars[len] = '\0';
+
+    erow *row = ropeInsertRow(at);
+    EDITOR.numrows++;
+
+    row->size = len;
+    row->chars = chars;
+    row->rxindex = NULL;
+    row->hlsize = 0;
+    row->hl_open_comment = 0;
+    row->mapped = 0;
+    row->ready = 1;
+    row->gen = EDITOR.save.gen;
+    editorSyntaxRowInserted(at);
+    editorDamageRowsFrom(at);
+
+    EDITOR.dirty++;
+}
+
+// gives a row its own copy of a line that still lives in the file mapping
+void editorRowDetach(erow *row){
+    if(!row->mapped) return;
+
+    char *chars = slabAlloc(row->size + 1);
+    memcpy(chars,
+           row->chars,
+           row->size);
+    chars[row->size] = '\0';
+    row->chars = chars;
+    row->mapped = 0;
+    row->gen = EDITOR.save.gen;
+}
+
+void editorFreeRow(erow *row){
+    slabFree(row->rxindex);
+    if(!row->mapped) editorFreeLater(row->chars, row->gen);
+    editorRowFreeHighlight(row);
+}
+
+void editorDelRow(int at){
+    if(at < 0 || at >= EDITOR.numrows) return;
+    erow *row = editorRowAt(at);
+    char *undo = editorUndoPush(UNDO_DELETE_ROWS, at, 1, row->size + 1);
+    if(undo){
+        memcpy(undo, row->chars, row->size);
+        undo[row->size] = '\n';
+    }
+    editorFreeRow(row);
+    EDITOR.rows = ropeDeleteRow(EDITOR.rows, at);
+    EDITOR.numrows--;
+    editorSyntaxRowDeleted(at);
+    editorDamageRowsFrom(at);
+    EDITOR.dirty++;
+}
+
+// inserts the rows in s, each one ending in a newline, as one edit.
+// like mapped rows they only keep a highlight once drawn
+void editorInsertRows(int at, char *s, size_t len){
+    if(at < 0 || at > EDITOR.numrows || len == 0)
+        return;
+
+    char *end = s + len;
+    char *p;
+    int n = 0;
+    for(p = s; (p = memchr(p, '\n', end - p)); p++)
+        n++;
+    char *undo = editorUndoPush(UNDO_INSERT_ROWS, at, n, len);
+    if(undo) memcpy(undo, s, len);
+
+    int filerow = at;
+    while(s < end){
+        char *nl = memchr(s, '\n', end - s);
+        size_t linelen = nl - s;
+        char *chars = slabAlloc(linelen + 1);
+        memcpy(chars,
+               s,
+               linelen);
+        chars[linelen] = '\0';
+
+        erow *row = ropeInsertRow(filerow++);
+        EDITOR.numrows++;
+
+        row->size = linelen;
+        row->chars = chars;
+        row->rxindex = NULL;
+        row->hlsize = 0;
+        row->hl_start = -1;
+        row->hl_open_comment = 0;
+        row->mapped = 0;
+        row->ready = 0;
+        row->gen = EDITOR.save.gen;
+        s = nl + 1;
+    }
+    editorSyntaxRowsMoved(at);
+    editorDamageRowsFrom(at);
+    EDITOR.dirty++;
+}
+
+// deletes `n` rows from `at` on as one edit
+void editorDelRows(int at, int n){
+    if(at < 0 || at >= EDITOR.numrows || n <= 0) return;
+    if(n > EDITOR.numrows - at) n = EDITOR.numrows - at;
+
+    int j;
+    size_t len = 0;
+    for(j = 0; j < n; j++)
+        len += editorRowAt(at + j)->size + 1;
+    char *undo = editorUndoPush(UNDO_DELETE_ROWS, at, n, len);
+    for(j = 0; j < n; j++){
+        erow *row = editorRowAt(at);
+        if(undo){
+            memcpy(undo, row->chars, row->size);
+            undo += row->size;
+            *undo++ = '\n';
+        }
+        editorFreeRow(row);
+        EDITOR.rows = ropeDeleteRow(EDITOR.rows, at);
+        EDITOR.numrows--;
+    }
+    editorSyntaxRowsMoved(at);
+    editorDamageRowsFrom(at);
+    EDITOR.dirty++;
+}
+
+void editorRowInsertChar(int filerow, int at, int c){
+    erow *row = editorRowOwn(filerow);
+    editorRowDetach(row);
+    if(at < 0 || at > row->size) at = row->size;
+    char *undo = editorUndoPush(UNDO_INSERT_TEXT, filerow, at, 1);
+    if(undo) *undo = c;
+    row->chars = slabRealloc(row->chars,
+                             row->size + 2);
     memmove(&row->chars[at + 1],
             &row->chars[at],
             row->size - at + 1);
     row->size++;
     row->chars[at] = c;
-    editorUpdateRow(row);
+    if(!editorRowPatch(filerow, at, 0, 1))
+        editorUpdateRow(filerow);
+    EDITOR.dirty++;
+}
+
+void editorRowInsertString(int filerow, int at, char *s, size_t len){
+    erow *row = editorRowOwn(filerow);
+    editorRowDetach(row);
+    if(at < 0 || at > row->size) at = row->size;
+    char *undo = editorUndoPush(UNDO_INSERT_TEXT, filerow, at, len);
+    if(undo) memcpy(undo, s, len);
+    row->chars = slabRealloc(row->chars,
+                             row->size + len + 1);
+    memmove(&row->chars[at + len],
+            &row->chars[at],
+            row->size - at + 1);
+    memcpy(&row->chars[at],
+           s,
+           len);
+    row->size += len;
+    if(!editorRowPatch(filerow, at, 0, len))
+        editorUpdateRow(filerow);
     EDITOR.dirty++;
 }
 
-void editorRowAppendString(erow *row, char *s, size_t len){
-    row->chars = realloc(row->chars,
-                         row->size + len + 1);
-    memcpy(&row->chars[row->size],
-           s,
-           len);
-    row->size += len;
-    row->chars[row->size] = '\0';
-    editorUpdateRow(row);
-    EDITOR.dirty++;
+void editorRowAppendString(int filerow, char *s, size_t len){
+    editorRowInsertString(filerow, editorRowAt(filerow)->size, s, len);
+}
+
+void editorRowDelString(int filerow, int at, int len){
+    erow *row = editorRowOwn(filerow);
+    if(at < 0 || at >= row->size || len <= 0) return;
+    if(len > row->size - at) len = row->size - at;
+    editorRowDetach(row);
+    char *undo = editorUndoPush(UNDO_DELETE_TEXT, filerow, at, len);
+    if(undo) memcpy(undo, &row->chars[at], len);
+    memmove(&row->chars[at],
+            &row->chars[at + len],
+            row->size - at - len + 1);
+    row->size -= len;
+    if(!editorRowPatch(filerow, at, len, 0))
+        editorUpdateRow(filerow);
+    EDITOR.dirty++;
+}
+
+void editorRowDelChar(int filerow, int at){
+    erow *row = editorRowOwn(filerow);
+    if(at < 0 || at >= row->size) return;
+    editorRowDetach(row);
+    char *undo = editorUndoPush(UNDO_DELETE_TEXT, filerow, at, 1);
+    if(undo) *undo = row->chars[at];
+    memmove(&row->chars[at],
+            &row->chars[at + 1],
+            row->size - at);
+    row->size--;
+    if(!editorRowPatch(filerow, at, 1, 0))
+        editorUpdateRow(filerow);
+    EDITOR.dirty++;
+}
+
+
+/*
+** Editor Operations
+*/
+void editorInsertChar(int c){
+    if(EDITOR.cy == EDITOR.numrows){
+        editorUndoBegin();
+        editorInsertRow(EDITOR.numrows,"", 0);
+        editorRowInsertChar(EDITOR.cy, EDITOR.cx, c);
+        editorUndoEnd();
+    } else {
+        editorRowInsertChar(EDITOR.cy,
+                            EDITOR.cx,
+                            c);
+    }
+    EDITOR.cx++;
+}
+
+// inserts text at the cursor as one undo step. every line past the first
+// goes in with a single editorInsertRows, so a big paste is one splice and
+// its rows are only highlighted once they are drawn
+void editorInsertText(char *s, size_t len){
+    char *nl = memchr(s, '\n', len);
+
+    editorUndoBegin();
+    if(EDITOR.cy == EDITOR.numrows)
+        editorInsertRow(EDITOR.numrows, "", 0);
+    if(nl == NULL){
+        editorRowInsertString(EDITOR.cy, EDITOR.cx, s, len);
+        EDITOR.cx += len;
+        editorUndoEnd();
+        return;
+    }
+
+    // the rest of the cursor row ends up after the last line
+    erow *row = editorRowAt(EDITOR.cy);
+    int rest = row->size - EDITOR.cx;
+    struct abuf rows = ABUF_INIT;
+    abAppend(&rows, nl + 1, s + len - (nl + 1));
+    abAppend(&rows, &row->chars[EDITOR.cx], rest);
+    abAppend(&rows, "\n", 1);
+
+    int n = 0;
+    char *last = nl, *p;
+    for(p = nl; p; p = memchr(p + 1, '\n', s + len - (p + 1))){
+        last = p;
+        n++;
+    }
+
+    editorRowDelString(EDITOR.cy, EDITOR.cx, rest);
+    editorRowInsertString(EDITOR.cy, EDITOR.cx, s, nl - s);
+    editorInsertRows(EDITOR.cy + 1, rows.b, rows.len);
+    abFree(&rows);
+    editorUndoEnd();
+
+    EDITOR.cy += n;
+    EDITOR.cx = s + len - (last + 1);
+}
+
+void editorInsertNewLine() {
+    if(EDITOR.cx == 0){
+        editorInsertRow(EDITOR.cy, "", 0);
+    } else {
+        editorUndoBegin();
+        erow *row = editorRowAt(EDITOR.cy);
+        editorInsertRow(EDITOR.cy + 1,
+                        &row->chars[EDITOR.cx],
+                        row->size - EDITOR.cx);
+        editorRowDelString(EDITOR.cy,
+                           EDITOR.cx,
+                           editorRowAt(EDITOR.cy)->size - EDITOR.cx);
+        editorUndoEnd();
+    }
+    EDITOR.cy++;
+    EDITOR.cx = 0;
+}
+
+
+void editorDelChar(){
+    if(EDITOR.cy == EDITOR.numrows) return;
+    if(EDITOR.cx == 0 && EDITOR.cy == 0) return;
+
+    erow *row = editorRowAt(EDITOR.cy);
+    if(EDITOR.cx > 0){
+        editorRowDelChar(EDITOR.cy, EDITOR.cx - 1);
+        EDITOR.cx--;
+    } else {
+        editorUndoBegin();
+        EDITOR.cx = editorRowAt(EDITOR.cy - 1)->size;
+        editorRowAppendString(EDITOR.cy - 1,
+                              row->chars,
+                              row->size);
+        editorDelRow(EDITOR.cy);
+        EDITOR.cy--;
+        editorUndoEnd();
+    }
+}
+
+// applies a record, or with `undo` set its inverse
+void editorUndoApply(struct undoRecord *r, int undo){
+    char *text = (char *)(r + 1);
+    switch(undo? r->op ^ 1 : r->op){
+        case UNDO_INSERT_TEXT:
+            editorRowInsertString(r->row, r->col, text, r->len);
+            break;
+        case UNDO_DELETE_TEXT:
+            editorRowDelString(r->row, r->col, r->len);
+            break;
+        case UNDO_INSERT_ROWS:
+            editorInsertRows(r->row, text, r->len);
+            break;
+        case UNDO_DELETE_ROWS:
+            editorDelRows(r->row, r->col);
+            break;
+    }
+}
+
+void editorUndoMoveCursor(int cx, int cy){
+    EDITOR.cy = cy < EDITOR.numrows? cy : EDITOR.numrows;
+    erow *row = editorRowAt(EDITOR.cy);
+    int size = row? row->size : 0;
+    EDITOR.cx = cx < size? cx : size;
+}
+
+// takes back the last step
+void editorUndo(){
+    struct editorUndo *u = &EDITOR.undo;
+    struct undoBlock *b = u->top;
+    long off = u->top_off;
+    struct undoRecord *r = editorUndoPrev(&b, &off);
+    if(r == NULL){
+        editorSetStatusMessage("Already at oldest change");
+        return;
+    }
+
+    int cx = EDITOR.cx, cy = EDITOR.cy;
+    u->suspend++;
+    while(1){
+        editorUndoApply(r, 1);
+        u->top = b;
+        u->top_off = off;
+        struct undoRecord *prev;
+        if(r->group || (prev = editorUndoPrev(&b, &off)) == NULL) break;
+        r = prev;
+    }
+    u->suspend--;
+    u->sealed = 1;
+
+    r->redo_cx = cx;
+    r->redo_cy = cy;
+    editorUndoMoveCursor(r->cx, r->cy);
+}
+
+// puts the last undone step back
+void editorRedo(){
+    struct editorUndo *u = &EDITOR.undo;
+    struct undoBlock *b = u->top;
+    long off = u->top_off;
+    struct undoRecord *group = editorUndoNext(&b, &off);
+    if(group == NULL){
+        editorSetStatusMessage("Already at newest change");
+        return;
+    }
+
+    u->suspend++;
+    struct undoRecord *r = group;
+    do {
+        editorUndoApply(r, 0);
+        u->top = b;
+        u->top_off = off;
+        r = editorUndoNext(&b, &off);
+    } while(r && !r->group);
+    u->suspend--;
+    u->sealed = 1;
+
+    editorUndoMoveCursor(group->redo_cx, group->redo_cy);
+}
+
+
+/*
+ * file i/o
+*/
+
+// the line of a mapped file starting at `off`, without its line break.
+// *next is where the line after it starts. indexing, saving and searching
+// all split lines here, so they always agree on them
+char *editorMapRow(char *map, size_t mapsize, size_t off,
+                   size_t *len, size_t *next){
+    char *line = &map[off];
+    size_t linelen = mapsize - off;
+
+    // libc's memchr is vectorized, so this is the fast newline scan
+    char *nl = memchr(line, '\n', linelen);
+    if(nl) linelen = nl - line;
+    *next = off + linelen + (nl != NULL);
+    while(linelen > 0 && line[linelen - 1] == '\r')
+        linelen--;
+    *len = linelen;
+    return line;
+}
+
+// splits more of the mapped file into rows until row `upto` exists
+// or the whole file is indexed. rows are only highlighted once drawn
+void editorIndexRows(int upto){
+    if(EDITOR.numrows > upto || EDITOR.mapoff >= EDITOR.mapsize) return;
+    editorDamageRowsFrom(EDITOR.numrows);
+
+    // the search worker reads the rope, keep it off while rows go in
+    int searching = EDITOR.search.running;
+    if(searching) editorSearchStop();
+
+    while(EDITOR.numrows <= upto
+          && EDITOR.mapoff < EDITOR.mapsize){
+        size_t linelen;
+        char *line = editorMapRow(EDITOR.map, EDITOR.mapsize,
+                                  EDITOR.mapoff, &linelen, &EDITOR.mapoff);
+
+        erow *row = ropeInsertRow(EDITOR.numrows);
+        EDITOR.numrows++;
+
+        row->size = linelen;
+        row->chars = line;
+        row->rxindex = NULL;
+        row->hlsize = 0;
+        row->hl_start = -1;
+        row->hl_open_comment = 0;
+        row->mapped = 1;
+        row->ready = 0;
+        row->gen = EDITOR.save.gen;
+    }
+    if(searching) editorSearchResume();
+}
+
+// write out the queued pieces, picking up after partial writes
+int editorSaveFlush(int fd, struct iovec *iov, int *cnt){
+    int i = 0;
+    while(i < *cnt){
+        ssize_t n = writev(fd, &iov[i], *cnt - i);
+        if(n == -1){
+            if(errno == EINTR) continue;
+            return -1;
+        }
+        while(i < *cnt && (size_t)n >= iov[i].iov_len){
+            n -= iov[i].iov_len;
+            i++;
+        }
+        if(i < *cnt){
+            iov[i].iov_base = (char *)iov[i].iov_base + n;
+            iov[i].iov_len -= n;
+        }
+    }
+    *cnt = 0;
+    return 0;
+}
+
+// queue `len` bytes at `s` for writev, growing the last piece when `s`
+// continues it. writes the queue out once it is full
+int editorSaveQueue(int fd, struct iovec *iov, int *cnt, char *s, size_t len){
+    if(len == 0) return 0;
+    if(*cnt && (char *)iov[*cnt - 1].iov_base + iov[*cnt - 1].iov_len == s){
+        iov[*cnt - 1].iov_len += len;
+        return 0;
+    }
+    if(*cnt == KILONE_SAVE_IOV && editorSaveFlush(fd, iov, cnt) == -1)
+        return -1;
+    iov[*cnt].iov_base = s;
+    iov[*cnt].iov_len = len;
+    (*cnt)++;
+    return 0;
+}
+
+// a line and its newline. lines still in the mapping are followed by
+// their own newline there, so untouched stretches of the file go out as
+// one piece
+int editorSaveLine(struct editorSaveJob *j, int fd, struct iovec *iov,
+                   int *cnt, char *s, size_t len){
+    if(j->map && s >= j->map
+       && s + len < j->map + j->mapsize
+       && s[len] == '\n')
+        return editorSaveQueue(fd, iov, cnt, s, len + 1);
+    if(editorSaveQueue(fd, iov, cnt, s, len) == -1) return -1;
+    return editorSaveQueue(fd, iov, cnt, "\n", 1);
+}
+
+// the bytes a row at file offset `off` takes up on disk if it is already
+// there, 0 if it has to be written. `mapsize` only covers the part of the
+// mapping the file still has. rows ending in \r\n are always written,
+// every line a save writes ends in a plain \n, so they would leave the
+// file with mixed line endings
+size_t editorRowOnDisk(erow *row, char *map, size_t mapsize, size_t off){
+    if(row->mapped? row->chars != map + off
+       : off + row->size >= mapsize
+         || memcmp(map + off, row->chars, row->size))
+        return 0;
+    if(off + row->size >= mapsize || map[off + row->size] != '\n') return 0;
+    return row->size + 1;
+}
+
+// the rows of a snapshot subtree, in order. in place, rows that are
+// still on disk are skipped and the writes seek to the ones that aren't
+int editorSaveNode(struct editorSaveJob *j, int fd, struct iovec *iov,
+                   int *cnt, struct ropeNode *t, size_t *written){
+    if(t == NULL) return 0;
+    if(editorSaveNode(j, fd, iov, cnt, t->left, written) == -1) return -1;
+    int i;
+    for(i = 0; i < t->nrows; i++){
+        erow *row = &t->rows[i];
+        if(j->inplace){
+            size_t n = editorRowOnDisk(row, j->map, j->ondisk, j->off);
+            if(n){
+                j->off += n;
+                if(editorSaveFlush(fd, iov, cnt) == -1) return -1;
+                continue;
+            }
+            if(*cnt == 0 && lseek(fd, j->off, SEEK_SET) == -1)
+                return -1;
+            j->off += row->size + 1;
+        }
+        if(editorSaveLine(j, fd, iov, cnt, row->chars, row->size) == -1)
+            return -1;
+        *written += row->size + 1;
+    }
+    // progress is published per chunk
+    __atomic_store_n(&j->written, *written, __ATOMIC_RELAXED);
+    return editorSaveNode(j, fd, iov, cnt, t->right, written);
+}
+
+// streams every row of the snapshot to fd, the rows that were never
+// indexed straight from the mapping. memory use doesn't depend on the
+// file size
+int editorSaveRows(struct editorSaveJob *j, int fd){
+    struct iovec iov[KILONE_SAVE_IOV];
+    int cnt = 0;
+    size_t written = 0;
+
+    j->off = 0;
+    if(editorSaveNode(j, fd, iov, &cnt, j->rows, &written) == -1)
+        return -1;
+    // in place, the rest of the mapping is still where it was
+    if(j->inplace && j->off == j->mapoff)
+        return editorSaveFlush(fd, iov, &cnt);
+
+    size_t off = j->mapoff;
+    while(off < j->mapsize){
+        size_t linelen;
+        char *line = editorMapRow(j->map, j->mapsize, off, &linelen, &off);
+        if(editorSaveLine(j, fd, iov, &cnt, line, linelen) == -1)
+            return -1;
+        written += linelen + 1;
+        __atomic_store_n(&j->written, written, __ATOMIC_RELAXED);
+    }
+
+    return editorSaveFlush(fd, iov, &cnt);
+}
+
+void editorOpen(char* filename) {
+    editorCloseBuffer();
+    free(EDITOR.filename);
+    EDITOR.filename = strdup(filename);
+
+    editorSelectSyntaxHighlight();
+
+    int fd = open(filename, O_RDONLY);
+    if(fd == -1) die("open");
+
+    // regular files are mapped and indexed lazily, so the first
+    // screen is ready no matter how big the file is
+    struct stat st;
+    if(fstat(fd, &st) == 0
+       && S_ISREG(st.st_mode)
+       && st.st_size > 0){
+        char *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if(map != MAP_FAILED){
+            close(fd);
+            EDITOR.disk = st;
+            EDITOR.disk_match = 1;
+            EDITOR.map = map;
+            EDITOR.mapsize = st.st_size;
+            EDITOR.mapoff = 0;
+            editorIndexRows(EDITOR.screenrows);
+            return;
+        }
+    }
+
+    FILE *fp = fdopen(fd, "r");
+    if(!fp) die("fdopen");
+
+    char *line = NULL;
+    size_t linecap = 0;
+    ssize_t linelen;
+
+    // loading the file is not an edit
+    EDITOR.undo.suspend++;
+    linelen = 0;
+    while((linelen = getline(&line, &linecap, fp)) != -1) {
+        if(linelen != -1){
+            while(linelen > 0 &&
+                (line[linelen-1] == '\n' ||
+                line[linelen - 1] == '\r')) {
+                linelen--;
+            }
+            editorInsertRow(EDITOR.numrows,line, linelen);
+        }
+    }
+    free(line);
+    fclose(fp);
+    EDITOR.undo.suspend--;
+    EDITOR.dirty = 0;
+}
+
+// runs on the writer thread, so failures are reported back instead of
+// ending the editor. writes a temporary file next to the real one and
+// renames it over it, so a failed save leaves the old file as it was
+void *editorSaveWorker(void *arg){
+    struct editorSaveJob *j = arg;
+
+    if(j->inplace){
+        int fd = open(j->path, O_WRONLY);
+        j->err = 0;
+        if(fd == -1
+           || editorSaveRows(j, fd) == -1
+           || ftruncate(fd, j->length) == -1
+           || fsync(fd) == -1
+           || fstat(fd, &j->st) == -1)
+            j->err = errno;
+        if(fd != -1 && close(fd) == -1 && !j->err)
+            j->err = errno;
+        __atomic_store_n(&j->done, 1, __ATOMIC_RELEASE);
+        loopWake();
+        return NULL;
+    }
+
+    int fd = mkstemp(j->tmp);
+    if(fd == -1) goto SAVE_FAILED;
+    if(fchmod(fd, j->mode) == -1
+       || editorSaveRows(j, fd) == -1
+       || fsync(fd) == -1)
+        goto SAVE_FAILED;
+    int err = close(fd);
+    fd = -1;
+    if(err == -1 || rename(j->tmp, j->path) == -1) goto SAVE_FAILED;
+
+    // make the rename itself durable
+    char *slash = strrchr(j->path, '/');
+    if(slash) *slash = '\0';
+    int dirfd = open(slash? (*j->path? j->path : "/") : ".", O_RDONLY);
+    if(dirfd != -1){
+        fsync(dirfd);
+        close(dirfd);
+    }
+
+    j->err = 0;
+    __atomic_store_n(&j->done, 1, __ATOMIC_RELEASE);
+    loopWake();
+    return NULL;
+
+    SAVE_FAILED:
+    j->err = errno;
+    if(fd != -1) close(fd);
+    unlink(j->tmp);
+    __atomic_store_n(&j->done, 1, __ATOMIC_RELEASE);
+    loopWake();
+    return NULL;
+}
+
+// picks up a finished save. edits made while it ran stay modified
+void editorSaveDrain(){
+    struct editorSaveJob *j = &EDITOR.save;
+    if(!j->running || !__atomic_load_n(&j->done, __ATOMIC_ACQUIRE))
+        return;
+
+    pthread_join(j->worker, NULL);
+    j->running = 0;
+
+    int i;
+    for(i = 0; i < j->ngarbage; i++)
+        slabFree(j->garbage[i]);
+    j->ngarbage = 0;
+    free(j->path);
+    free(j->tmp);
+
+    // a read only private mapping sees the writes of an in place save,
+    // a renamed file is a different one. a failed in place save may
+    // have written anything
+    if(j->inplace){
+        EDITOR.disk_match = !j->err;
+        EDITOR.disk = j->st;
+    } else if(!j->err){
+        EDITOR.disk_match = 0;
+    }
+
+    if(j->err){
+        editorSetStatusMessage("Cant save! I/O error: %s", strerror(j->err));
+        return;
+    }
+    editorSetStatusMessage("%zu bytes written to disk", j->written);
+    EDITOR.dirty -= j->dirty;
+}
+
+// blocks until the running save is done, before exiting
+void editorSaveWait(){
+    struct editorSaveJob *j = &EDITOR.save;
+    if(!j->running) return;
+    // the worker wakes the loop once done, editorSaveDrain joins it
+    while(!__atomic_load_n(&j->done, __ATOMIC_ACQUIRE)){
+        struct pollfd fd = {EDITOR.loop.wake[0], POLLIN, 0};
+        poll(&fd, 1, -1);
+        loopWoken(EDITOR.loop.wake[0]);
+    }
+    // a search worker may have woken it too
+    loopWake();
+    editorSaveDrain();
+}
+
+// drops every row. they, their buffers and the rope nodes all live in the
+// row storage, so this is a free per slab rather than several per row
+void editorCloseBuffer(){
+    editorSaveWait();
+    slabRelease();
+    EDITOR.rows = NULL;
+    EDITOR.numrows = 0;
+    if(EDITOR.map) munmap(EDITOR.map, EDITOR.mapsize);
+    EDITOR.map = NULL;
+    EDITOR.mapsize = 0;
+    EDITOR.mapoff = 0;
+    EDITOR.disk_match = 0;
+    EDITOR.hl_clean = 0;
+    EDITOR.hl_resume = 0;
+    EDITOR.cx = EDITOR.cy = 0;
+    EDITOR.rowoff = EDITOR.coloff = 0;
+    EDITOR.dirty = 0;
+    editorUndoClear();
+    editorDamageAll();
+}
+
+// adds up the rows of a subtree for editorSavePlan. with `detach` set,
+// mapped rows that will be written are copied out of the mapping first,
+// and rows an earlier save put on disk go back to pointing there
+void editorSavePlanNode(struct ropeNode *t, size_t *off, size_t *copy,
+                        int detach){
+    if(t == NULL) return;
+    editorSavePlanNode(t->left, off, copy, detach);
+    int i;
+    for(i = 0; i < t->nrows; i++){
+        erow *row = &t->rows[i];
+        size_t n = editorRowOnDisk(row, EDITOR.map, EDITOR.save.ondisk, *off);
+        if(n){
+            if(detach && !row->mapped){
+                slabFree(row->chars);
+                row->chars = EDITOR.map + *off;
+                row->mapped = 1;
+            }
+            *off += n;
+            continue;
+        }
+        if(row->mapped){
+            *copy += row->size;
+            if(detach) editorRowDetach(row);
+        }
+        *off += row->size + 1;
+    }
+    editorSavePlanNode(t->right, off, copy, detach);
+}
+
+// whether the part of the mapping that was never indexed can stay on disk
+// as it is. a save ends every line in a plain \n, so a \r in there or a
+// missing newline at the end of the file has to be written like any
+// other changed row
+int editorSaveTailOnDisk(){
+    size_t len = EDITOR.mapsize - EDITOR.mapoff;
+    return EDITOR.map[EDITOR.mapsize - 1] == '\n'
+        && memchr(&EDITOR.map[EDITOR.mapoff], '\r', len) == NULL;
+}
+
+// decides whether the file can be updated in place, writing only the rows
+// that aren't on disk where they belong anymore. once an edit shifts the
+// offsets everything after it has to move, and whatever of that is still
+// in the mapping gets copied first, since writing the file changes what
+// the mapping reads. that is only done for a bounded amount, saves with
+// earlier shifts rewrite the whole file
+int editorSavePlan(struct stat *st){
+    if(EDITOR.map == NULL || !EDITOR.disk_match
+       || st->st_dev != EDITOR.disk.st_dev
+       || st->st_ino != EDITOR.disk.st_ino
+       || st->st_size != EDITOR.disk.st_size
+       || st->st_mtime != EDITOR.disk.st_mtime)
+        return 0;
+
+    EDITOR.save.ondisk = EDITOR.mapsize < (size_t)st->st_size?
+                         EDITOR.mapsize : (size_t)st->st_size;
+    size_t off = 0, copy = 0;
+    editorSavePlanNode(EDITOR.rows, &off, &copy, 0);
+    int tail = EDITOR.mapoff < EDITOR.mapsize
+        && (off != EDITOR.mapoff || !editorSaveTailOnDisk());
+    if(tail) copy += EDITOR.mapsize - EDITOR.mapoff;
+    if(copy > KILONE_SAVE_COPY_MAX) return 0;
+
+    if(tail) editorIndexRows(INT_MAX);
+    off = 0;
+    editorSavePlanNode(EDITOR.rows, &off, &copy, 1);
+    if(!tail && EDITOR.mapoff < EDITOR.mapsize)
+        off += EDITOR.mapsize - EDITOR.mapoff;
+    EDITOR.save.length = off;
+    return 1;
+}
+
+void editorSave(){
+    struct editorSaveJob *j = &EDITOR.save;
+    if(j->running){
+        editorSetStatusMessage("Already saving");
+        return;
+    }
+
+    if(EDITOR.filename == NULL){
+        EDITOR.filename = editorPrompt("Save as: %s", NULL);
+        if(EDITOR.filename == NULL) {
+            editorSetStatusMessage("Save aborted!");
+            return;
+        }
+
+        editorSelectSyntaxHighlight();
+    }
+
+    // the mapping keeps the old contents alive for the rows that still
+    // point there
+    j->path = realpath(EDITOR.filename, NULL);
+    if(j->path == NULL) j->path = strdup(EDITOR.filename);
+    j->tmp = malloc(strlen(j->path) + 8);
+    if(j->path == NULL || j->tmp == NULL) die("malloc");
+    sprintf(j->tmp, "%s.XXXXXX", j->path);
+
+    struct stat st;
+    j->inplace = 0;
+    if(stat(j->path, &st) == 0){
+        j->mode = st.st_mode & 07777;
+        j->inplace = editorSavePlan(&st);
+    } else {
+        mode_t mask = umask(0);
+        umask(mask);
+        j->mode = 0644 & ~mask;
+    }
+
+    // everything allocated from here on belongs to the editor alone
+    j->gen++;
+    j->rows = EDITOR.rows;
+    j->map = EDITOR.map;
+    j->mapsize = EDITOR.mapsize;
+    j->mapoff = EDITOR.mapoff;
+    j->dirty = EDITOR.dirty;
+    j->written = 0;
+    j->done = 0;
+    int err = pthread_create(&j->worker, NULL, editorSaveWorker, j);
+    if(err != 0){
+        editorSetStatusMessage("Cant save! %s", strerror(err));
+        free(j->path);
+        free(j->tmp);
+        return;
+    }
+    j->running = 1;
+}
+
+/*
+ * Regex
+ */
+
+// patterns are parsed into a tree, compiled to two nfas and matched with
+// dfas built lazily from those, so matching never backtracks and stays
+// linear in the row length. supported: literals, . [] [^] \d \w \s (and
+// upper case negations), * + ? {m,n}, | () ^ $
+
+int regexNewNode(struct regex *re, int op, int left, int right){
+    if(re->nnodes == re->nodecap){
+        re->nodecap = re->nodecap? re->nodecap * 2 : 64;
+        re->nodes = realloc(re->nodes, re->nodecap * sizeof(struct regexNode));
+        if(re->nodes == NULL) die("realloc");
+    }
+    struct regexNode *n = &re->nodes[re->nnodes];
+    n->op = op;
+    n->set = -1;
+    n->min = n->max = 0;
+    n->left = left;
+    n->right = right;
+    return re->nnodes++;
+}
+
+int regexNewSet(struct regex *re){
+    if(re->nsets == re->setcap){
+        re->setcap = re->setcap? re->setcap * 2 : 16;
+        re->sets = realloc(re->sets, re->setcap * sizeof(struct regexSet));
+        if(re->sets == NULL) die("realloc");
+    }
+    memset(&re->sets[re->nsets], 0, sizeof(struct regexSet));
+    return re->nsets++;
+}
+
+void regexSetAdd(struct regex *re, int set, int lo, int hi){
+    int c;
+    for(c = lo; c <= hi; c++)
+        re->sets[set].bits[c >> 3] |= 1 << (c & 7);
+}
+
+int regexSetHas(struct regex *re, int set, int c){
+    return re->sets[set].bits[c >> 3] & (1 << (c & 7));
+}
+
+void regexSetInvert(struct regex *re, int set){
+    int i;
+    for(i = 0; i < 32; i++)
+        re->sets[set].bits[i] = ~re->sets[set].bits[i];
+}
+
+// \d \w \s and their negations, returns 0 for other escapes
+int regexClassEscape(struct regex *re, int set, int c){
+    int s = regexNewSet(re);
+    switch(tolower(c)){
+        case 'd':
+            regexSetAdd(re, s, '0', '9');
+            break;
+        case 'w':
+            regexSetAdd(re, s, '0', '9');
+            regexSetAdd(re, s, 'a', 'z');
+            regexSetAdd(re, s, 'A', 'Z');
+            regexSetAdd(re, s, '_', '_');
+            break;
+        case 's':
+            regexSetAdd(re, s, ' ', ' ');
+            regexSetAdd(re, s, '\t', '\r');
+            break;
+        default:
+            re->nsets--;
+            return 0;
+    }
+    if(isupper(c)) regexSetInvert(re, s);
+    int i;
+    for(i = 0; i < 32; i++)
+        re->sets[set].bits[i] |= re->sets[s].bits[i];
+    re->nsets--;
+    return 1;
+}
+
+int regexEscapeChar(int c){
+    switch(c){
+        case 't': return '\t';
+        case 'n': return '\n';
+        case 'r': return '\r';
+    }
+    return c;
+}
+
+int regexParseAlt(struct regex *re, const char **pp);
+
+int regexParseClass(struct regex *re, const char **pp){
+    const char *p = *pp;
+    int set = regexNewSet(re);
+    int negate = 0;
+    if(*p == '^'){
+        negate = 1;
+        p++;
+    }
+    int first = 1;
+    while(*p && (*p != ']' || first)){
+        first = 0;
+        int lo = (unsigned char)*p++;
+        if(lo == '\\' && *p){
+            if(regexClassEscape(re, set, (unsigned char)*p)){
+                p++;
+                continue;
+            }
+            lo = regexEscapeChar((unsigned char)*p++);
+        }
+        int hi = lo;
+        if(p[0] == '-' && p[1] && p[1] != ']'){
+            p++;
+            hi = (unsigned char)*p++;
+            if(hi == '\\' && *p) hi = regexEscapeChar((unsigned char)*p++);
+            if(hi < lo){
+                re->error = "bad range in []";
+                return -1;
+            }
+        }
+        regexSetAdd(re, set, lo, hi);
+    }
+    if(*p != ']'){
+        re->error = "missing ]";
+        return -1;
+    }
+    *pp = p + 1;
+    if(negate) regexSetInvert(re, set);
+    int n = regexNewNode(re, RXN_SET, -1, -1);
+    re->nodes[n].set = set;
+    return n;
+}
+
+int regexParseAtom(struct regex *re, const char **pp){
+    const char *p = *pp;
+    int n, set;
+    switch(*p){
+        case '(':
+            *pp = p + 1;
+            n = regexParseAlt(re, pp);
+            if(n < 0) return -1;
+            if(**pp != ')'){
+                re->error = "missing )";
+                return -1;
+            }
+            (*pp)++;
+            return n;
+        case '[':
+            *pp = p + 1;
+            return regexParseClass(re, pp);
+        case '^':
+            *pp = p + 1;
+            return regexNewNode(re, RXN_BOL, -1, -1);
+        case '$':
+            *pp = p + 1;
+            return regexNewNode(re, RXN_EOL, -1, -1);
+        case '*': case '+': case '?':
+            re->error = "nothing to repeat";
+            return -1;
+    }
+
+    set = regexNewSet(re);
+    if(*p == '.'){
+        regexSetAdd(re, set, 0, 255);
+        p++;
+    } else if(*p == '\\' && p[1]){
+        if(!regexClassEscape(re, set, (unsigned char)p[1])){
+            int c = regexEscapeChar((unsigned char)p[1]);
+            regexSetAdd(re, set, c, c);
+        }
+        p += 2;
+    } else {
+        regexSetAdd(re, set, (unsigned char)*p, (unsigned char)*p);
+        p++;
+    }
+    *pp = p;
+    n = regexNewNode(re, RXN_SET, -1, -1);
+    re->nodes[n].set = set;
+    return n;
+}
+
+// {m}, {m,} or {m,n}. anything else is a literal {
+int regexParseCount(const char **pp, int *min, int *max){
+    const char *p = *pp + 1;
+    if(!isdigit((unsigned char)*p)) return 0;
+    long n = strtol(p, (char **)&p, 10);
+    *min = n < INT_MAX? n : INT_MAX;
+    *max = *min;
+    if(*p == ','){
+        p++;
+        *max = -1;
+        if(isdigit((unsigned char)*p)){
+            n = strtol(p, (char **)&p, 10);
+            *max = n < INT_MAX? n : INT_MAX;
+        }
+    }
+    if(*p != '}') return 0;
+    *pp = p + 1;
+    return 1;
+}
+
+int regexParseRepeat(struct regex *re, const char **pp){
+    int n = regexParseAtom(re, pp);
+    while(n >= 0){
+        int min, max;
+        char c = **pp;
+        if(c == '*'){
+            min = 0;
+            max = -1;
+        } else if(c == '+'){
+            min = 1;
+            max = -1;
+        } else if(c == '?'){
+            min = 0;
+            max = 1;
+        } else if(c == '{' && regexParseCount(pp, &min, &max)){
+            if(min > KILONE_REGEX_MAX_REPEAT || max > KILONE_REGEX_MAX_REPEAT){
+                re->error = "repeat count too big";
+                return -1;
+            }
+            if(max != -1 && max < min){
+                re->error = "bad repeat count";
+                return -1;
+            }
+            c = 0;
+        } else {
+            break;
+        }
+        if(c) (*pp)++;
+        n = regexNewNode(re, RXN_REPEAT, n, -1);
+        re->nodes[n].min = min;
+        re->nodes[n].max = max;
+    }
+    return n;
+}
+
+int regexParseCat(struct regex *re, const char **pp){
+    int n = regexNewNode(re, RXN_EMPTY, -1, -1);
+    while(**pp && **pp != '|' && **pp != ')'){
+        int m = regexParseRepeat(re, pp);
+        if(m < 0) return -1;
+        n = regexNewNode(re, RXN_CAT, n, m);
+    }
+    return n;
+}
+
+int regexParseAlt(struct regex *re, const char **pp){
+    int n = regexParseCat(re, pp);
+    while(n >= 0 && **pp == '|'){
+        (*pp)++;
+        int m = regexParseCat(re, pp);
+        if(m < 0) return -1;
+        n = regexNewNode(re, RXN_ALT, n, m);
+    }
+    return n;
+}
+
+int regexEmit(struct regex *re, struct regexProg *p, int op, int set, int out, int out1){
+    if(p->ninst == KILONE_REGEX_MAX_INSTS){
+        re->error = "pattern too big";
+        return 0;
+    }
+    if(p->ninst == p->instcap){
+        p->instcap = p->instcap? p->instcap * 2 : 64;
+        p->inst = realloc(p->inst, p->instcap * sizeof(struct regexInst));
+        if(p->inst == NULL) die("realloc");
+    }
+    struct regexInst *in = &p->inst[p->ninst];
+    in->op = op;
+    in->set = set;
+    in->out = out;
+    in->out1 = out1;
+    return p->ninst++;
+}
+
+// emit code matching `node` that continues at `next`, returns its entry.
+// reversed code matches the node's text backwards
+int regexCompileNode(struct regex *re, struct regexProg *p, int node, int next, int reverse){
+    if(re->error) return next;
+    struct regexNode *n = &re->nodes[node];
+    int i;
+    switch(n->op){
+        case RXN_SET:
+            return regexEmit(re, p, RX_SET, n->set, next, -1);
+        case RXN_BOL:
+            return regexEmit(re, p, RX_BOL, -1, next, -1);
+        case RXN_EOL:
+            return regexEmit(re, p, RX_EOL, -1, next, -1);
+        case RXN_CAT:
+            if(reverse)
+                return regexCompileNode(re, p, n->right,
+                    regexCompileNode(re, p, n->left, next, reverse),
+                    reverse);
+            return regexCompileNode(re, p, n->left,
+                regexCompileNode(re, p, n->right, next, reverse),
+                reverse);
+        case RXN_ALT: {
+            int a = regexCompileNode(re, p, n->left, next, reverse);
+            int b = regexCompileNode(re, p, n->right, next, reverse);
+            return regexEmit(re, p, RX_SPLIT, -1, a, b);
+        }
+        case RXN_REPEAT: {
+            int min = n->min, max = n->max, child = n->left;
+            if(max == -1){
+                int loop = regexEmit(re, p, RX_SPLIT, -1, -1, next);
+                int body = regexCompileNode(re, p, child, loop, reverse);
+                if(re->error) return next;
+                p->inst[loop].out = body;
+                next = loop;
+            } else {
+                for(i = min; i < max && !re->error; i++)
+                    next = regexEmit(re, p, RX_SPLIT, -1,
+                        regexCompileNode(re, p, child, next, reverse),
+                        next);
+            }
+            for(i = 0; i < min && !re->error; i++)
+                next = regexCompileNode(re, p, child, next, reverse);
+            return next;
+        }
+    }
+    return next;
+}
+
+// split the bytes into classes no set tells apart, the dfas step on
+// those instead of on bytes
+void regexByteClasses(struct regex *re){
+    int cls[256], map[2][256];
+    int n = 1, i, b;
+    memset(cls, 0, sizeof(cls));
+    for(i = 0; i < re->nsets; i++){
+        memset(map, -1, sizeof(map));
+        int m = 0;
+        for(b = 0; b < 256; b++){
+            int *slot = &map[regexSetHas(re, i, b)? 1 : 0][cls[b]];
+            if(*slot == -1) *slot = m++;
+            cls[b] = *slot;
+        }
+        n = m;
+    }
+    for(b = 0; b < 256; b++){
+        re->bclass[b] = cls[b];
+        re->rep[cls[b]] = b;
+    }
+    re->bol = n;
+    re->eol = n + 1;
+    re->nsym = n + 2;
+}
+
+void regexProgInit(struct regexProg *p, int nsym){
+    p->nsym = nsym;
+    p->nstates = 0;
+    p->startstate = -1;
+    p->poolsize = 0;
+    p->poolcap = 0;
+    p->pool = NULL;
+    p->setoff = malloc(KILONE_REGEX_MAX_STATES * sizeof(int));
+    p->setlen = malloc(KILONE_REGEX_MAX_STATES * sizeof(int));
+    p->next = malloc((size_t)KILONE_REGEX_MAX_STATES * nsym * sizeof(int));
+    p->accept = malloc(KILONE_REGEX_MAX_STATES);
+    p->tablemask = KILONE_REGEX_MAX_STATES * 2 - 1;
+    p->table = malloc((p->tablemask + 1) * sizeof(int));
+    p->scratch = malloc(p->ninst * sizeof(int));
+    p->stack = malloc((2 * p->ninst + 2) * sizeof(int));
+    p->mark = calloc(p->ninst, sizeof(unsigned int));
+    p->gen = 0;
+    if(!p->setoff || !p->setlen || !p->next || !p->accept || !p->table
+       || !p->scratch || !p->stack || !p->mark)
+        die("malloc");
+    memset(p->table, -1, (p->tablemask + 1) * sizeof(int));
+}
+
+void regexProgFree(struct regexProg *p){
+    free(p->inst);
+    free(p->setoff);
+    free(p->setlen);
+    free(p->pool);
+    free(p->next);
+    free(p->accept);
+    free(p->table);
+    free(p->scratch);
+    free(p->stack);
+    free(p->mark);
+}
+
+void regexFree(struct regex *re){
+    if(re == NULL) return;
+    free(re->nodes);
+    free(re->sets);
+    regexProgFree(&re->fwd);
+    regexProgFree(&re->rev);
+    free(re);
+}
+
+// the bytes every match has to start with, ^ aside
+void regexPrefix(struct regex *re, int node, int *stop){
+    struct regexNode *n = &re->nodes[node];
+    if(*stop) return;
+    switch(n->op){
+        case RXN_EMPTY:
+        case RXN_BOL:
+            return;
+        case RXN_CAT:
+            regexPrefix(re, n->left, stop);
+            regexPrefix(re, n->right, stop);
+            return;
+        case RXN_SET: {
+            int b, c = -1, count = 0;
+            for(b = 0; b < 256 && count < 2; b++)
+                if(regexSetHas(re, n->set, b)){
+                    c = b;
+                    count++;
+                }
+            if(count == 1 && re->prefix_len < KILONE_REGEX_MAX_PREFIX){
+                re->prefix[re->prefix_len++] = c;
+                return;
+            }
+        }
+    }
+    *stop = 1;
+}
+
+// add `pc` and every instruction reachable from it without consuming
+// input to the set being built
+void regexClosure(struct regexProg *p, int pc, int *n){
+    int sp = 0;
+    p->stack[sp++] = pc;
+    while(sp){
+        pc = p->stack[--sp];
+        if(p->mark[pc] == p->gen) continue;
+        p->mark[pc] = p->gen;
+        if(p->inst[pc].op == RX_SPLIT){
+            p->stack[sp++] = p->inst[pc].out1;
+            p->stack[sp++] = p->inst[pc].out;
+        } else {
+            p->scratch[(*n)++] = pc;
+        }
+    }
+}
+
+int regexIntCmp(const void *a, const void *b){
+    return *(const int *)a - *(const int *)b;
+}
+
+void regexNewGen(struct regexProg *p){
+    if(++p->gen == 0){
+        memset(p->mark, 0, p->ninst * sizeof(unsigned int));
+        p->gen = 1;
+    }
+}
+
+// find or add the state for the set in scratch. when the cache is full it
+// is thrown away and rebuilt as needed, which keeps memory bounded
+// without giving up linear time. returns -1 if out of memory: this runs
+// on the search worker, where not finding a match beats dying
+int regexDfaState(struct regexProg *p, int n, int *flushed){
+    qsort(p->scratch, n, sizeof(int), regexIntCmp);
+    unsigned int h = 2166136261u;
+    int i;
+    for(i = 0; i < n; i++){
+        h ^= p->scratch[i];
+        h *= 16777619u;
+    }
+
+    unsigned int slot = h & p->tablemask;
+    while(p->table[slot] != -1){
+        int st = p->table[slot];
+        if(p->setlen[st] == n
+           && !memcmp(&p->pool[p->setoff[st]], p->scratch, n * sizeof(int)))
+            return st;
+        slot = (slot + 1) & p->tablemask;
+    }
+
+    if(p->nstates == KILONE_REGEX_MAX_STATES){
+        p->nstates = 0;
+        p->poolsize = 0;
+        p->startstate = -1;
+        memset(p->table, -1, (p->tablemask + 1) * sizeof(int));
+        *flushed = 1;
+        slot = h & p->tablemask;
+    }
+    if(p->poolsize + n > p->poolcap){
+        int cap = p->poolcap? p->poolcap : 1024;
+        while(cap < p->poolsize + n) cap *= 2;
+        int *pool = realloc(p->pool, cap * sizeof(int));
+        if(pool == NULL) return -1;
+        p->pool = pool;
+        p->poolcap = cap;
+    }
+
+    int st = p->nstates++;
+    p->setoff[st] = p->poolsize;
+    p->setlen[st] = n;
+    memcpy(&p->pool[p->poolsize], p->scratch, n * sizeof(int));
+    p->poolsize += n;
+    p->accept[st] = 0;
+    for(i = 0; i < n; i++)
+        if(p->inst[p->scratch[i]].op == RX_MATCH)
+            p->accept[st] = 1;
+    for(i = 0; i < p->nsym; i++)
+        p->next[st * p->nsym + i] = -2;
+    p->table[slot] = st;
+    return st;
+}
+
+int regexStart(struct regexProg *p){
+    if(p->startstate == -1){
+        int n = 0, flushed = 0;
+        regexNewGen(p);
+        regexClosure(p, p->start, &n);
+        p->startstate = regexDfaState(p, n, &flushed);
+    }
+    return p->startstate;
+}
+
+int regexStep(struct regex *re, struct regexProg *p, int state, int sym){
+    int next = p->next[state * p->nsym + sym];
+    if(next != -2) return next;
+
+    int n = 0, flushed = 0, i;
+    regexNewGen(p);
+    int *set = &p->pool[p->setoff[state]];
+    for(i = 0; i < p->setlen[state]; i++){
+        struct regexInst *in = &p->inst[set[i]];
+        if(in->op == RX_ANY
+           || (in->op == RX_SET && sym < re->bol
+               && regexSetHas(re, in->set, re->rep[sym]))
+           || (in->op == RX_BOL && sym == re->bol)
+           || (in->op == RX_EOL && sym == re->eol))
+            regexClosure(p, in->out, &n);
+    }
+    next = n? regexDfaState(p, n, &flushed) : -1;
+    if(!flushed) p->next[state * p->nsym + sym] = next;
+    return next;
+}
+
+// symbol `pos` of a row: the start of line, its bytes, the end of line
+int regexSymbol(struct regex *re, const char *text, int len, int pos){
+    if(pos == 0) return re->bol;
+    if(pos == len + 1) return re->eol;
+    return re->bclass[(unsigned char)text[pos - 1]];
+}
+
+struct regex *regexCompile(const char *pattern, const char **error){
+    struct regex *re = calloc(1, sizeof(struct regex));
+    if(re == NULL) die("calloc");
+
+    const char *p = pattern;
+    int root = regexParseAlt(re, &p);
+    if(root >= 0 && *p == ')') re->error = "unmatched )";
+    if(re->error) goto fail;
+
+    regexByteClasses(re);
+    int stop = 0;
+    regexPrefix(re, root, &stop);
+
+    // forward: the start of line is optional so matches at column 0 can
+    // be run from the first byte or from the start of line symbol
+    int match = regexEmit(re, &re->fwd, RX_MATCH, -1, -1, -1);
+    int entry = regexCompileNode(re, &re->fwd, root, match, 0);
+    int bol = regexEmit(re, &re->fwd, RX_BOL, -1, entry, -1);
+    re->fwd.start = regexEmit(re, &re->fwd, RX_SPLIT, -1, bol, entry);
+
+    // reverse: the pattern backwards behind a loop over anything, it is in
+    // a matching state at every position a match starts
+    match = regexEmit(re, &re->rev, RX_MATCH, -1, -1, -1);
+    entry = regexCompileNode(re, &re->rev, root, match, 1);
+    re->rev.start = regexEmit(re, &re->rev, RX_SPLIT, -1, -1, entry);
+    int any = regexEmit(re, &re->rev, RX_ANY, -1, re->rev.start, -1);
+    if(re->error) goto fail;
+    re->rev.inst[re->rev.start].out = any;
+
+    regexProgInit(&re->fwd, re->nsym);
+    regexProgInit(&re->rev, re->nsym);
+
+    // only the start and end of line, no bytes, can't be told apart from
+    // a match everywhere
+    struct regexProg *f = &re->fwd;
+    int s0 = regexStart(f);
+    int s1 = regexStep(re, f, s0, re->bol);
+    int s2 = s1 >= 0? regexStep(re, f, s1, re->eol) : -1;
+    int s3 = regexStep(re, f, regexStart(f), re->eol);
+    if(f->accept[regexStart(f)] || (s1 >= 0 && f->accept[s1])
+       || (s2 >= 0 && f->accept[s2]) || (s3 >= 0 && f->accept[s3])){
+        re->error = "pattern matches empty text";
+        goto fail;
+    }
+    return re;
+
+    fail:
+    *error = re->error;
+    regexFree(re);
+    return NULL;
 }
 
-void editorRowDelChar(erow *row, int at){
-    if(at < 0 || at >= row->size) return;
-    memmove(&row->chars[at],
-            &row->chars[at + 1],
-            row->size - at);
-    row->size--;
-    editorUpdateRow(row);
-    EDITOR.dirty++;
+// columns in [from, to) where a match starts, ascending, into *out.
+// the reversed pattern is run once from the end of the row, so this is
+// linear in the row length. returns -1 if out of memory
+int regexStarts(struct regex *re, const char *text, int len, int from, int to, int **out, int *cap){
+    if(re->prefix_len){
+        char *f = editorSearchMem(&text[from], len - from,
+                                  re->prefix, re->prefix_len);
+        if(f == NULL) return 0;
+        from = f - text;
+    }
+    if(from >= to) return 0;
+
+    struct regexProg *p = &re->rev;
+    int state = regexStart(p);
+    int n = 0, pos;
+    int limit = from? from + 1 : 0;
+    for(pos = len + 1; pos >= limit && state >= 0; pos--){
+        state = regexStep(re, p, state, regexSymbol(re, text, len, pos));
+        if(state < 0 || !p->accept[state]) continue;
+
+        int col = pos? pos - 1 : 0;
+        if(col >= to || (n && (*out)[n - 1] == col)) continue;
+        if(n == *cap){
+            int newcap = *cap? *cap * 2 : 64;
+            int *grown = realloc(*out, newcap * sizeof(int));
+            if(grown == NULL) return -1;
+            *out = grown;
+            *cap = newcap;
+        }
+        (*out)[n++] = col;
+    }
+    if(state < 0) return -1;
+
+    int i;
+    for(i = 0; i < n / 2; i++){
+        int t = (*out)[i];
+        (*out)[i] = (*out)[n - 1 - i];
+        (*out)[n - 1 - i] = t;
+    }
+    return n;
 }
 
+// length of the longest match starting at `col`
+int regexMatchLen(struct regex *re, const char *text, int len, int col){
+    struct regexProg *p = &re->fwd;
+    int state = regexStart(p);
+    int end = col, pos;
+    for(pos = col? col + 1 : 0; pos <= len + 1 && state >= 0; pos++){
+        state = regexStep(re, p, state, regexSymbol(re, text, len, pos));
+        if(state >= 0 && p->accept[state])
+            end = pos < len? pos : len;
+    }
+    return end - col;
+}
 
 /*
-** Editor Operations
-*/
-void editorInsertChar(int c){
-    if(EDITOR.cy == EDITOR.numrows){
-        editorInsertRow(EDITOR.numrows,"", 0);
+ * Find
+ */
+
+// first occurrence of `needle` in `hay`. candidates are the positions
+// where both the first and the last byte of the needle match, tested 16
+// at a time, and only those get a memcmp
+char *editorSearchMem(const char *hay, int hlen, const char *needle, int nlen){
+    if(nlen > hlen) return NULL;
+    if(nlen == 1) return memchr(hay, needle[0], hlen);
+
+    int i = 0;
+#ifdef __SSE2__
+    const __m128i first = _mm_set1_epi8(needle[0]);
+    const __m128i last = _mm_set1_epi8(needle[nlen - 1]);
+    for(; i + nlen - 1 + 16 <= hlen; i += 16){
+        __m128i a = _mm_loadu_si128((const __m128i *)&hay[i]);
+        __m128i b = _mm_loadu_si128((const __m128i *)&hay[i + nlen - 1]);
+        unsigned int mask = _mm_movemask_epi8(
+            _mm_and_si128(_mm_cmpeq_epi8(a, first),
+                          _mm_cmpeq_epi8(b, last)));
+        while(mask){
+            int j = i + __builtin_ctz(mask);
+            if(!memcmp(&hay[j + 1], &needle[1], nlen - 2))
+                return (char *)&hay[j];
+            mask &= mask - 1;
+        }
     }
-    editorRowInsertChar(&EDITOR.row[EDITOR.cy],
-                        EDITOR.cx,
-                        c);
-    EDITOR.cx++;
+#endif
+    return memmem(&hay[i], hlen - i, needle, nlen);
 }
 
-void editorInsertNewLine() {
-    if(EDITOR.cx == 0){
-        editorInsertRow(EDITOR.cy, "", 0);
-    } else {
-        erow *row = &EDITOR.row[EDITOR.cy];
-        editorInsertRow(EDITOR.cy + 1,
-                        &row->chars[EDITOR.cx],
-                        row->size - EDITOR.cx);
-        row = &EDITOR.row[EDITOR.cy];
-        row->size = EDITOR.cx;
-        row->chars[row->size] = '\0';
-        editorUpdateRow(row);
+void editorSearchAdd(struct searchMatch *m, int n){
+    struct editorSearch *s = &EDITOR.search;
+    if(s->nmatches + n > s->cap){
+        while(s->nmatches + n > s->cap)
+            s->cap = s->cap? s->cap * 2 : 256;
+        s->matches = realloc(s->matches, s->cap * sizeof(struct searchMatch));
+        if(s->matches == NULL) die("realloc");
     }
-    EDITOR.cy++;
-    EDITOR.cx = 0;
+    if(n) memcpy(&s->matches[s->nmatches], m, n * sizeof(struct searchMatch));
+    s->nmatches += n;
 }
 
+// hand found matches and the scan position over to the ui thread
+void editorSearchPublish(struct searchMatch *m, int n, struct searchPos *pos, int done){
+    struct editorSearch *s = &EDITOR.search;
+    pthread_mutex_lock(&s->lock);
+    if(s->npending + n > s->pending_cap){
+        while(s->npending + n > s->pending_cap)
+            s->pending_cap = s->pending_cap? s->pending_cap * 2 : KILONE_SEARCH_BATCH;
+        // no die() off the main thread, a failed realloc ends the scan
+        struct searchMatch *pending = realloc(s->pending,
+            s->pending_cap * sizeof(struct searchMatch));
+        if(pending == NULL){
+            s->worker_done = 1;
+            pthread_mutex_unlock(&s->lock);
+            loopWake();
+            return;
+        }
+        s->pending = pending;
+    }
+    if(n) memcpy(&s->pending[s->npending], m, n * sizeof(struct searchMatch));
+    s->npending += n;
+    s->reached = *pos;
+    s->worker_done = done;
+    pthread_mutex_unlock(&s->lock);
+    loopWake();
+}
 
-void editorDelChar(){
-    if(EDITOR.cy == EDITOR.numrows) return;
-    if(EDITOR.cx == 0 && EDITOR.cy == 0) return;
+// looks for matches in text[pos->col, to) of the row at pos, `size` being
+// the whole row. returns 1 when the worker has to stop, pos->col is where
+// it got to
+int editorSearchText(struct searchBatch *b, struct searchPos *pos,
+                     char *text, int size, int to){
+    struct editorSearch *s = &EDITOR.search;
+
+    // a pattern finds all of a row's match starts in one pass
+    int nstarts = 0, si = 0;
+    if(s->regex && pos->col < to){
+        nstarts = regexStarts(s->re, text, size, pos->col, to,
+                              &b->starts, &b->startcap);
+        if(nstarts < 0) return 1;
+    }
 
-    erow *row = &EDITOR.row[EDITOR.cy];
-    if(EDITOR.cx > 0){
-        editorRowDelChar(row, EDITOR.cx - 1);
-        EDITOR.cx--;
-    } else {
-        EDITOR.cx = EDITOR.row[EDITOR.cy - 1].size;
-        editorRowAppendString(&EDITOR.row[EDITOR.cy - 1],
-                              row->chars,
-                              row->size);
-        editorDelRow(EDITOR.cy);
-        EDITOR.cy--;
+    while(pos->col < to){
+        if(__atomic_load_n(&s->cancel, __ATOMIC_RELAXED)) return 1;
+        int start;
+        if(s->regex){
+            if(si == nstarts) break;
+            start = b->starts[si++];
+        } else {
+            int end = (to - pos->col > KILONE_SEARCH_SLICE)?
+                pos->col + KILONE_SEARCH_SLICE : to;
+            int hend = (end + s->qlen - 1 < size)? end + s->qlen - 1 : size;
+
+            // overlapping matches are kept, a longer query may narrow
+            // to any of them
+            char *match = editorSearchMem(&text[pos->col], hend - pos->col,
+                                          s->query, s->qlen);
+            if(match == NULL){
+                pos->col = end;
+                continue;
+            }
+            start = match - text;
+        }
+        if(b->found == s->job_room){
+            pos->col = start;
+            return 1;
+        }
+        b->m[b->n].row = pos->row;
+        b->m[b->n].col = start;
+        b->m[b->n].off = pos->off;
+        b->n++;
+        b->found++;
+        pos->col = start + 1;
+
+        // the first hit goes out right away so it can be shown
+        if(b->n == KILONE_SEARCH_BATCH || b->found == 1){
+            editorSearchPublish(b->m, b->n, pos, 0);
+            b->n = 0;
+        }
     }
+    return 0;
 }
 
+// scans from job to the end of the file and from its start back to the
+// anchor, in slices so cancellation is noticed quickly even on very long
+// rows. rows the ui thread hadn't indexed are read from the mapping
+void *editorSearchWorker(void *arg){
+    (void)arg;
+    struct editorSearch *s = &EDITOR.search;
+    struct searchBatch b;
+    struct searchPos pos = s->job;
+    b.n = 0;
+    b.found = 0;
+    b.starts = NULL;
+    b.startcap = 0;
 
-/*
- * file i/o
-*/
-
-char* editorRowsToString(int *buflen){
-    int totlen = 0;
-    int j;
-    for(j = 0; j < EDITOR.numrows; j++){
-        totlen += EDITOR.row[j].size + 1;
-    }
-    *buflen = totlen;
-
-    char *buf = malloc(totlen);
-    char *p = buf;
-    for(j = 0;j < EDITOR.numrows; j++){
-        memcpy(p,
-               EDITOR.row[j].chars,
-               EDITOR.row[j].size);
-        p += EDITOR.row[j].size;
-        *p = '\n';
-        p++;
+    while(1){
+        if(__atomic_load_n(&s->cancel, __ATOMIC_RELAXED)) break;
+        if(!pos.wrapped && pos.row == s->job_numrows) pos.off = s->job_mapoff;
+        if(!pos.wrapped && pos.row >= s->job_numrows
+           && pos.off >= EDITOR.mapsize){
+            pos.row = 0;
+            pos.col = 0;
+            pos.wrapped = 1;
+        }
+        if(pos.wrapped && pos.row > s->anchor_row) break;
+
+        char *text;
+        int size;
+        size_t next = 0;
+        if(pos.wrapped || pos.row < s->job_numrows){
+            erow *row = editorRowAt(pos.row);
+            text = row->chars;
+            size = row->size;
+        } else {
+            size_t len;
+            text = editorMapRow(EDITOR.map, EDITOR.mapsize, pos.off,
+                                &len, &next);
+            size = len;
+        }
+        int to = size;
+        if(pos.wrapped && pos.row == s->anchor_row && to > s->anchor_col)
+            to = s->anchor_col;
+        if(editorSearchText(&b, &pos, text, size, to)) break;
+        pos.row++;
+        pos.col = 0;
+        pos.off = next;
     }
 
-    return buf;
+    free(b.starts);
+    editorSearchPublish(b.m, b.n, &pos, 1);
+    return NULL;
 }
 
-void editorOpen(char* filename) {
-    free(EDITOR.filename);
-    EDITOR.filename = strdup(filename);
+// move what the worker found into the index, and join it once it is done
+void editorSearchDrain(){
+    struct editorSearch *s = &EDITOR.search;
+    if(!s->running) return;
+
+    pthread_mutex_lock(&s->lock);
+    editorSearchAdd(s->pending, s->npending);
+    s->npending = 0;
+    s->scanned = s->reached;
+    int done = s->worker_done;
+    pthread_mutex_unlock(&s->lock);
+
+    s->complete = s->scanned.wrapped && s->scanned.row > s->anchor_row;
+    if(done){
+        pthread_join(s->worker, NULL);
+        s->running = 0;
+    }
+}
 
-    editorSelectSyntaxHighlight();
+void editorSearchStop(){
+    struct editorSearch *s = &EDITOR.search;
+    if(!s->running) return;
+    __atomic_store_n(&s->cancel, 1, __ATOMIC_RELAXED);
+    pthread_join(s->worker, NULL);
+    s->worker_done = 1;
+    editorSearchDrain();
+}
 
-    FILE *fp = fopen(filename, "r");
-    if(!fp) die("fopen");
+// continue the index from where it was scanned to
+void editorSearchResume(){
+    struct editorSearch *s = &EDITOR.search;
+    if(s->complete || s->qlen == 0) return;
+    s->cancel = 0;
+    s->job = s->scanned;
+    s->job_numrows = EDITOR.numrows;
+    s->job_mapoff = EDITOR.mapoff;
+    s->job_room = KILONE_SEARCH_MAX_MATCHES - s->nmatches;
+    s->reached = s->scanned;
+    s->worker_done = 0;
+    if(pthread_create(&s->worker, NULL, editorSearchWorker, NULL) != 0)
+        die("pthread_create");
+    s->running = 1;
+}
 
-    char *line = NULL;
-    size_t linecap = 0;
-    ssize_t linelen;
+// throw the index away and rebuild it starting at (row, col)
+void editorSearchScan(int row, int col){
+    struct editorSearch *s = &EDITOR.search;
+    s->nmatches = 0;
+    s->current = -1;
+    if(row >= EDITOR.numrows){
+        row = 0;
+        col = 0;
+    }
+    s->anchor_row = row;
+    s->anchor_col = col;
+    s->scanned.row = row;
+    s->scanned.col = col;
+    s->scanned.off = 0;
+    s->scanned.wrapped = 0;
+    s->complete = s->qlen == 0 || EDITOR.numrows == 0;
+    editorSearchResume();
+}
 
-    linelen = 0;
-    while((linelen = getline(&line, &linecap, fp)) != -1) {
-        if(linelen != -1){
-            while(linelen > 0 &&
-                (line[linelen-1] == '\n' ||
-                line[linelen - 1] == '\r')) {
-                linelen--;
-            }
-            editorInsertRow(EDITOR.numrows,line, linelen);
+// the query grew by a suffix: only positions that matched before can
+// match now, so filter the index instead of searching again
+void editorSearchNarrow(int oldlen){
+    struct editorSearch *s = &EDITOR.search;
+    int kept = 0, current = -1;
+    int i;
+    for(i = 0; i < s->nmatches; i++){
+        struct searchMatch m = s->matches[i];
+        int size;
+        char *text;
+        if(m.row < EDITOR.numrows){
+            erow *row = editorRowAt(m.row);
+            text = row->chars;
+            size = row->size;
+        } else {
+            size_t len, next;
+            text = editorMapRow(EDITOR.map, EDITOR.mapsize, m.off,
+                                &len, &next);
+            size = len;
         }
+        if(m.col + s->qlen > size
+           || memcmp(&text[m.col + oldlen],
+                     &s->query[oldlen],
+                     s->qlen - oldlen))
+            continue;
+        // stay on the selected match, or the next one that survives
+        if(current == -1 && i >= s->current) current = kept;
+        s->matches[kept++] = m;
     }
-    free(line);
-    fclose(fp);
-    EDITOR.dirty = 0;
+    s->nmatches = kept;
+    s->current = (current == -1 && kept)? 0 : current;
 }
 
-void editorSave(){
-    if(EDITOR.filename == NULL){
-        EDITOR.filename = editorPrompt("Save as: %s", NULL);
-        if(EDITOR.filename == NULL) {
-            editorSetStatusMessage("Save aborted!");
+void editorSearchUpdate(char *query){
+    struct editorSearch *s = &EDITOR.search;
+    int qlen = strlen(query);
+    int oldlen = s->qlen;
+    if(qlen == oldlen && (qlen == 0 || !memcmp(query, s->query, qlen))) return;
+
+    editorSearchStop();
+    // a longer pattern can match where a shorter one didn't
+    int extends = oldlen > 0 && qlen > oldlen
+        && !memcmp(query, s->query, oldlen)
+        && !s->regex;
+
+    // keep the search where it is while the query is edited
+    int row = s->origin_row, col = s->origin_col;
+    if(s->current != -1){
+        row = s->matches[s->current].row;
+        col = s->matches[s->current].col;
+    }
+
+    s->query = realloc(s->query, qlen + 1);
+    if(s->query == NULL) die("realloc");
+    memcpy(s->query, query, qlen + 1);
+    s->qlen = qlen;
+
+    regexFree(s->re);
+    s->re = NULL;
+    s->error = NULL;
+    if(s->regex && qlen){
+        s->re = regexCompile(query, &s->error);
+        if(s->re == NULL){
+            s->nmatches = 0;
+            s->current = -1;
+            s->complete = 1;
             return;
         }
-
-        editorSelectSyntaxHighlight();
     }
 
-    int len;
-    char *buf = editorRowsToString(&len);
-
-    int fd = open(EDITOR.filename,
-                  O_RDWR | O_CREAT,
-                  0644);
-    if(fd != 1){
-        if(ftruncate(fd,len) != 1){
-            if(write(fd,buf,len) == len){
-                close(fd);
-                free(buf);
-                editorSetStatusMessage("%d bytes written to disk", len);
-                EDITOR.dirty = 0;
-                return;
-            }
-        }
-        close(fd);
+    if(extends){
+        // what was scanned so far only needs filtering, the worker picks
+        // up the rest with the new query
+        editorSearchNarrow(oldlen);
+        editorSearchResume();
+    } else {
+        editorSearchScan(row, col);
     }
-    free(buf);
-    editorSetStatusMessage("Cant save! I/O error: %s:", strerror(errno));
 }
 
-/*
- * Find
- */
+void editorSearchStep(int direction){
+    struct editorSearch *s = &EDITOR.search;
+    if(s->current == -1) return;
+    if(direction > 0 && s->current == s->nmatches - 1 && !s->complete){
+        // still coming in, or the index ran full: continue it from the
+        // last match
+        if(s->running) return;
+        struct searchMatch m = s->matches[s->current];
+        editorSearchScan(m.row, m.col + 1);
+        return;
+    }
+    if(direction < 0 && s->current == 0 && !s->complete) return;
+    s->current = (s->current + direction + s->nmatches) % s->nmatches;
+}
 
-void editorFindCallback(char* query, int key){
-    static int last_match = -1;
-    static int direction = 1;
+void editorSearchClearOverlay(){
+    struct editorSearch *s = &EDITOR.search;
+    if(s->overlay_row == -1) return;
+    editorDamageRow(s->overlay_row);
+    s->overlay_row = -1;
+}
 
-    // the currently highlighted characters in the search
-    // so we can clear the highlight later
-    static int saved_hl_line;
-    static char *saved_hl = NULL;
+// move to the selected match and color it
+void editorSearchShow(){
+    struct editorSearch *s = &EDITOR.search;
+    if(s->current == -1) return;
+    struct searchMatch m = s->matches[s->current];
+    editorIndexRows(m.row);
+    EDITOR.cy = m.row;
+    EDITOR.cx = m.col;
+    EDITOR.rowoff = EDITOR.numrows;
+
+    // Lets also color the matching characters shall we?
+    erow *row = editorRowAt(m.row);
+    int len = s->regex?
+        regexMatchLen(s->re, row->chars, row->size, m.col) :
+        s->qlen;
+    s->overlay_row = m.row;
+    s->overlay_start = m.col;
+    s->overlay_end = m.col + len;
+    editorDamageRow(m.row);
+}
 
-    if(saved_hl){
-        memcpy(EDITOR.row[saved_hl_line].highlight,
-               saved_hl,
-               EDITOR.row[saved_hl_line].rsize);
-        free(saved_hl);
-        saved_hl = NULL;
+void editorFindCallback(char* query, int key){
+    struct editorSearch *s = &EDITOR.search;
+
+    if(key == KILONE_TICK){
+        editorSearchDrain();
+        // show the first hit as soon as there is one
+        if(s->current == -1 && s->nmatches){
+            s->current = 0;
+            editorSearchShow();
+        }
+        return;
     }
 
+    editorSearchClearOverlay();
+
     if(key == '\r' || key == '\x1b'){
-        last_match = -1;
-        direction = 1;
+        editorSearchStop();
         return;
     }
+    else if(key == CTRL_KEY('r')) {
+        // switch between literal and regex search, and search again
+        editorSearchStop();
+        s->regex = !s->regex;
+        s->qlen = 0;
+        s->current = -1;
+        editorSearchUpdate(query);
+    }
     else if(key == CURSOR_RIGHT || key == CURSOR_DOWN) {
-        direction = 1;
+        editorSearchDrain();
+        editorSearchStep(1);
     }
     else if(key == CURSOR_LEFT || key == CURSOR_UP) {
-        direction = -1;
-            }
-    else {
-        last_match = -1;
-        direction = 1;
+        editorSearchDrain();
+        editorSearchStep(-1);
     }
-
-
-    if(last_match == -1) direction = 1;
-    int current = last_match;
-    int i;
-    for(i = 0; i < EDITOR.numrows; i++){
-        current += direction;
-        if(current == -1) current = EDITOR.numrows - 1;
-        else if (current == EDITOR.numrows) current = 0;
-
-
-        erow *row = &EDITOR.row[i];
-
-        char *match = strstr(row->render, query);
-        if(match){
-            last_match = current;
-            EDITOR.cy = current;
-            EDITOR.cx = editorRowRxToCx(row, match - row->render);
-            EDITOR.rowoff = EDITOR.numrows;
-
-            // Lets also color the matching characters shall we?
-            saved_hl_line = current;
-            saved_hl = malloc(row->rsize);
-            memcpy(saved_hl,
-                   row->highlight,
-                   row->rsize);
-            memset(&row->highlight[match - row->render],
-                   KILONE_HL_MATCH,
-                   strlen(query));
-            break;
-        }
+    else {
+        editorSearchUpdate(query);
     }
 
+    editorSearchShow();
 }
 
 void editorFind() {
@@ -607,8 +3802,21 @@ void editorFind() {
     int saved_coloff = EDITOR.coloff;
     int saved_rowoff = EDITOR.rowoff;
 
-    char *query = editorPrompt("Search: %s (Use ESC/Arrows/Enter)",
+    struct editorSearch *s = &EDITOR.search;
+    s->active = 1;
+    s->qlen = 0;
+    s->nmatches = 0;
+    s->complete = 1;
+    s->current = -1;
+    s->origin_row = EDITOR.cy;
+    s->origin_col = EDITOR.cx;
+    s->overlay_row = -1;
+    s->error = NULL;
+
+    char *query = editorPrompt("Search: %s (ESC/Arrows/Enter, Ctrl-R regex)",
                                editorFindCallback);
+    editorSearchStop();
+    s->active = 0;
 
     if(query){
         free(query);
@@ -621,32 +3829,115 @@ void editorFind() {
     }
 }
 
-
-
 /*
  * Append Buffer
 */
-struct abuf {
-    char *b;
-    int len;
-};
-
-#define ABUF_INIT {NULL, 0};
 
+// capacity grows geometrically and survives abReset, so a buffer reused
+// for every frame stops allocating once it has seen the biggest one
 void abAppend(struct abuf *ab, const char *s, int len){
-    char* new = realloc(ab->b,
-                        ab->len + len);
-
-    if(new == NULL) return;
-    memcpy(&new[ab->len],
+    if(len == 0) return;
+    if(ab->len + len > ab->cap){
+        int cap = ab->cap? ab->cap : 4096;
+        while(cap < ab->len + len) cap *= 2;
+        char* new = realloc(ab->b, cap);
+        if(new == NULL) die("realloc");
+        ab->b = new;
+        ab->cap = cap;
+    }
+    memcpy(&ab->b[ab->len],
            s,
            len);
-    ab->b = new;
     ab->len += len;
 }
 
+void abReset(struct abuf *ab){
+    ab->len = 0;
+}
+
 void abFree(struct abuf *ab){
     free(ab->b);
+    ab->b = NULL;
+    ab->len = 0;
+    ab->cap = 0;
+}
+
+/*
+ * Screen
+ */
+
+// the drawing code goes through these, either into curses or straight
+// into the vt frame buffer
+
+void screenMove(int y, int x){
+    if(EDITOR.renderer == KILONE_RENDERER_CURSES){
+        move(y, x);
+        return;
+    }
+    char buf[32];
+    int len = snprintf(buf, sizeof(buf), "\x1b[%d;%dH", y + 1, x + 1);
+    abAppend(&EDITOR.frame, buf, len);
+}
+
+void screenPut(const char *s, int len){
+    if(EDITOR.renderer == KILONE_RENDERER_CURSES){
+        addnstr(s, len);
+        return;
+    }
+    abAppend(&EDITOR.frame, s, len);
+}
+
+// switch to the colors of highlight `hl`, or back to the defaults if 0
+void screenColor(int hl){
+    if(EDITOR.renderer == KILONE_RENDERER_CURSES){
+        attrset(hl? COLOR_PAIR(hl) : A_NORMAL);
+        return;
+    }
+    if(hl == EDITOR.frame_color) return;
+    EDITOR.frame_color = hl;
+    char buf[32];
+    int len = hl?
+        snprintf(buf, sizeof(buf), "\x1b[0;%sm", KILONE_VT_COLORS[hl]) :
+        snprintf(buf, sizeof(buf), "\x1b[m");
+    abAppend(&EDITOR.frame, buf, len);
+}
+
+void screenClearEol(){
+    if(EDITOR.renderer == KILONE_RENDERER_CURSES){
+        clrtoeol();
+        return;
+    }
+    abAppend(&EDITOR.frame, "\x1b[K", 3);
+}
+
+void screenBeginFrame(){
+    if(EDITOR.renderer == KILONE_RENDERER_CURSES) return;
+    abReset(&EDITOR.frame);
+    EDITOR.frame_color = -1;
+    abAppend(&EDITOR.frame, "\x1b[?25l", 6);
+}
+
+// put the cursor at (y, x) and hand the frame to the terminal
+void screenEndFrame(int y, int x){
+    if(EDITOR.renderer == KILONE_RENDERER_CURSES){
+        move(y, x);
+        refresh();
+        return;
+    }
+    screenMove(y, x);
+    abAppend(&EDITOR.frame, "\x1b[?25h", 6);
+
+    int off = 0;
+    while(off < EDITOR.frame.len){
+        ssize_t n = write(STDOUT_FILENO,
+                          &EDITOR.frame.b[off],
+                          EDITOR.frame.len - off);
+        if(n == -1){
+            if(errno == EINTR) continue;
+            die("write");
+        }
+        off += n;
+    }
 }
 
 /*
@@ -655,9 +3946,12 @@ void abFree(struct abuf *ab){
 
 
 void editorScroll(){
+    editorIndexRows(EDITOR.rowoff + EDITOR.screenrows);
+    editorIndexRows(EDITOR.cy + 1);
+
     EDITOR.rx = 0;
     if(EDITOR.cy < EDITOR.numrows){
-        EDITOR.rx = editorRowCxToRx(&EDITOR.row[EDITOR.cy],
+        EDITOR.rx = editorRowCxToRx(editorRowAt(EDITOR.cy),
                                     EDITOR.cx);
     }
 
@@ -676,6 +3970,97 @@ void editorScroll(){
     }
 }
 
+// draw `n` blanks with as few writes as possible
+void editorDrawBlank(int n){
+    static const char blanks[] = "                                "
+                                 "                                ";
+    while(n > 0){
+        int chunk = n < (int)sizeof(blanks) - 1? n : (int)sizeof(blanks) - 1;
+        screenPut(blanks, chunk);
+        n -= chunk;
+    }
+}
+
+// draw a row from screen column `coloff` on, at most `width` cells, one
+// attribute change and one write per span. tabs are expanded as they are
+// drawn and the bytes [mark, mark_end) are drawn as a search match whatever
+// their own highlight. control characters are substituted by a symbol in
+// comment color
+void editorDrawRow(erow *row, int coloff, int width, int mark, int mark_end){
+    static struct hlBuffer spans;
+
+    char *c = row->chars;
+    int rx;
+    int j = editorRowRxToCx(row, coloff, &rx);
+    if(j == row->size) return;
+
+    editorRowGetHighlight(row, j, j + width, &spans);
+    struct hlSpan *hl = spans.spans;
+    int n = spans.count;
+
+    // the first span that ends past j
+    int lo = 0, hi = n;
+    while(lo < hi){
+        int mid = (lo + hi) / 2;
+        if(editorSpanEnd(&hl[mid]) <= j) lo = mid + 1;
+        else hi = mid;
+    }
+
+    int cur = lo;
+    int room = width;
+    while(j < row->size && room > 0){
+        int color = editorSpanClass(hl, n, &cur, j);
+        int stop = row->size;
+        if(color != KILONE_HL_NORMAL) stop = editorSpanEnd(&hl[cur]);
+        else if(cur < n) stop = hl[cur].start;
+
+        if(j >= mark && j < mark_end){
+            color = KILONE_HL_MATCH;
+            stop = mark_end;
+        } else if(j < mark && stop > mark){
+            stop = mark;
+        }
+        if(stop > row->size) stop = row->size;
+
+        while(j < stop && room > 0){
+            int k = j;
+            if(c[j] == '\t'){
+                // the left edge may cut a tab short
+                int w = KILONE_TAB_STOP - rx % KILONE_TAB_STOP;
+                rx += w;
+                if(w > rx - coloff) w = rx - coloff;
+                if(w > room) w = room;
+                screenColor(color);
+                editorDrawBlank(w);
+                room -= w;
+                k++;
+            } else if(iscntrl((unsigned char)c[j])){
+                char sym[64];
+                while(k < stop && k - j < (int)sizeof(sym) && k - j < room
+                      && c[k] != '\t' && iscntrl((unsigned char)c[k])){
+                    sym[k - j] = ((unsigned char)c[k] < 26)?
+                        '@' + c[k] : '?';
+                    k++;
+                }
+                screenColor(KILONE_HL_COMMENT);
+                screenPut(sym, k - j);
+                rx += k - j;
+                room -= k - j;
+            } else {
+                while(k < stop && k - j < room
+                      && !iscntrl((unsigned char)c[k]))
+                    k++;
+                screenColor(color);
+                screenPut(&c[j], k - j);
+                rx += k - j;
+                room -= k - j;
+            }
+            j = k;
+        }
+    }
+    screenColor(0);
+}
+
 void editorPrintMOTD(char* motd){
     char welcome[80];
     int welcomelen = snprintf(welcome, sizeof(welcome),
@@ -687,49 +4072,45 @@ void editorPrintMOTD(char* motd){
 
     int padding = (EDITOR.screencols - welcomelen) / 2;
     if(padding){
-        addnstr( "~", 1);
+        screenPut("~", 1);
         padding --;
     }
-    while(padding--) addnstr( " ", 1);
-    addnstr( welcome, welcomelen);
+    editorDrawBlank(padding);
+    screenPut(welcome, welcomelen);
 }
 
 void editorDrawRows(){
     int y;
+    // highlight first, re-lexing a row damages it
+    for(y = 0; y < EDITOR.screenrows; y++){
+        int filerow = y + EDITOR.rowoff;
+        if(filerow < EDITOR.numrows)
+            editorPrepareRow(filerow);
+    }
+
     for(y = 0; y < EDITOR.screenrows; y++){
+        if(!EDITOR.damage[y]) continue;
+        EDITOR.damage[y] = 0;
+        screenMove(y, 0);
+
         int filerow = y + EDITOR.rowoff;
         if(filerow >= EDITOR.numrows){
             // Print MOTD if file is empty
             if(EDITOR.numrows == 0 && y == EDITOR.screenrows / 3) {
                 editorPrintMOTD("mockery is flattery");
             } else {
-                addnstr( "~", 1);
+                screenPut("~", 1);
             }
         } else {
-            int len = EDITOR.row[filerow].rsize - EDITOR.coloff;
-            if(len < 0) len = 0;
-            if(len > EDITOR.screencols) len = EDITOR.screencols;
-
-            char *c = &EDITOR.row[filerow].render[EDITOR.coloff];
-            unsigned char *hl = &EDITOR.row[filerow].highlight[EDITOR.coloff];
-            int j;
-            for(j = 0; j < len; j++){
-                if(iscntrl(c[j])){
-                    char sym = (c[j] < 26)?
-                        '@' + c[j]: '?';
-                    color_set(COLOR_PAIR(KILONE_HL_COMMENT),0);
-                    addnstr(&sym, 1);
-                    attroff(COLOR_PAIR(KILONE_HL_COMMENT));
-                }
-                attron(COLOR_PAIR(hl[j]));
-                addnstr( &c[j], 1);
-                attroff(COLOR_PAIR(hl[j]));
-            }
+            struct editorSearch *s = &EDITOR.search;
+            int overlay = (s->active && s->overlay_row == filerow);
+            editorDrawRow(editorRowAt(filerow),
+                          EDITOR.coloff,
+                          EDITOR.screencols,
+                          overlay? s->overlay_start : -1,
+                          overlay? s->overlay_end : -1);
         }
-
-
-        // make a newline
-        addnstr( "\n", 2);
+        screenClearEol();
     }
 }
 
@@ -759,70 +4140,119 @@ void editorSwitchMode(int mode){
             break;
     }
     EDITOR.cur_mode = mode;
+    // typing is never merged across a mode switch. within one stay in
+    // insert mode, edits grouped with editorUndoBegin (breaking or joining
+    // lines, a paste) are steps of their own and end the one before
+    editorUndoBreak();
 }
 
 void editorDrawStatusBar(){
+    static char drawn_status[120], drawn_rstatus[120];
 
-    attron(COLOR_PAIR(KILONE_HL_STATUS));
     char status[120], rstatus[120];
+    char state[40] = "";
+    if(EDITOR.save.running)
+        snprintf(state, sizeof(state),
+                 "(saving %zu KB)",
+                 __atomic_load_n(&EDITOR.save.written, __ATOMIC_RELAXED) / 1024);
+    else if(EDITOR.dirty)
+        strcpy(state, "(modified)");
     int len = snprintf(status, sizeof(status),
-                       "%.20s - %d lines %s",
+                       "%.20s - %d%s lines %s",
                        EDITOR.filename ? EDITOR.filename : "[No Name]",
                        EDITOR.numrows,
-                       EDITOR.dirty? "(modified)" : "");
+                       EDITOR.mapoff < EDITOR.mapsize ? "+" : "",
+                       state);
+    char matches[40] = "";
+    if(EDITOR.search.active && EDITOR.search.error)
+        snprintf(matches, sizeof(matches),
+                 "%.30s | ",
+                 EDITOR.search.error);
+    else if(EDITOR.search.active)
+        snprintf(matches, sizeof(matches),
+                 "%s %d/%d%s | ",
+                 EDITOR.search.regex ? "regex" : "match",
+                 EDITOR.search.current + 1,
+                 EDITOR.search.nmatches,
+                 EDITOR.search.running ? "..." :
+                 !EDITOR.search.complete ? "+" : "");
     int rlen = snprintf(rstatus, sizeof(rstatus),
-                        "%s | %s | %d/%d",
+                        "%s%s | %s | %d/%d",
+                        matches,
                         editorModeEnumToStr(EDITOR.cur_mode),
                         EDITOR.syntax?
                             EDITOR.syntax->filetype :
                             "no ft",
                         EDITOR.cy + 1,
                         EDITOR.numrows);
+
+    if(!EDITOR.damage[EDITOR.screenrows]
+       && !strcmp(status, drawn_status)
+       && !strcmp(rstatus, drawn_rstatus))
+        return;
+    EDITOR.damage[EDITOR.screenrows] = 0;
+    strcpy(drawn_status, status);
+    strcpy(drawn_rstatus, rstatus);
+
+    screenMove(EDITOR.screenrows, 0);
+    screenColor(KILONE_HL_STATUS);
     if(len > EDITOR.screencols)
         len = EDITOR.screencols;
-    addnstr( status, len);
-    while(len < EDITOR.screencols){
-        if(EDITOR.screencols - len == rlen){
-            addnstr( rstatus, rlen);
-            break;
-        }
-        addnstr( " ", 1);
-        len++;
+    screenPut(status, len);
+    if(EDITOR.screencols - len >= rlen){
+        editorDrawBlank(EDITOR.screencols - len - rlen);
+        screenPut(rstatus, rlen);
+    } else {
+        editorDrawBlank(EDITOR.screencols - len);
     }
-    attroff(COLOR_PAIR(KILONE_HL_STATUS));
-
-
-    addnstr( "\n", 1);
+    screenColor(0);
 }
 
 void editorDrawMessageBar(){
-    int msglen = strlen(EDITOR.statusmsg);
+    static char drawn_msg[80];
+
+    char *msg = (editorNowMs() - EDITOR.statusmsg_time < KILONE_STATUS_MS)?
+        EDITOR.statusmsg :
+        "";
+    if(!EDITOR.damage[EDITOR.screenrows + 1]
+       && !strcmp(msg, drawn_msg))
+        return;
+    EDITOR.damage[EDITOR.screenrows + 1] = 0;
+    strcpy(drawn_msg, msg);
+
+    int msglen = strlen(msg);
     if(msglen > EDITOR.screencols)
         msglen = EDITOR.screencols;
-    if(msglen && time(NULL) - EDITOR.statusmsg_time < 5)
-        addnstr(EDITOR.statusmsg,
-                 msglen);
-    int i = msglen;
-    while(i < EDITOR.screencols){
-        addnstr(" ",1);
-        i++;
-    }
+    screenMove(EDITOR.screenrows + 1, 0);
+    screenPut(msg, msglen);
+    screenClearEol();
 }
 
 void editorRefreshScreen(){
+    editorSaveDrain();
     editorScroll();
 
-    // put cursor in the top left corner
-    move(0,0);
+    // everything on screen moved
+    if(EDITOR.rowoff != EDITOR.drawn_rowoff
+       || EDITOR.coloff != EDITOR.drawn_coloff){
+        editorDamageLines(0, EDITOR.screenrows - 1);
+        EDITOR.drawn_rowoff = EDITOR.rowoff;
+        EDITOR.drawn_coloff = EDITOR.coloff;
+    }
 
+    screenBeginFrame();
     editorDrawRows();
     editorDrawStatusBar();
     editorDrawMessageBar();
 
     // Move the cursor to its current position
-    move((EDITOR.cy - EDITOR.rowoff),
-         (EDITOR.rx - EDITOR.coloff));
+    screenEndFrame((EDITOR.cy - EDITOR.rowoff),
+                   (EDITOR.rx - EDITOR.coloff));
+
+}
 
+void editorStatusExpired(){
+    EDITOR.damage[EDITOR.screenrows + 1] = 1;
 }
 
 void editorSetStatusMessage(const char *fmt, ...){
@@ -832,33 +4262,171 @@ void editorSetStatusMessage(const char *fmt, ...){
               fmt,
               ap);
     va_end(ap);
-    EDITOR.statusmsg_time = time(NULL);
+    EDITOR.statusmsg_time = editorNowMs();
+    // wake up to take it down again
+    loopTimer(editorStatusExpired, KILONE_STATUS_MS);
 }
 
 /*
  * Input
  */
+
+// keys are decoded from the bytes the terminal sends rather than by
+// curses, so a lone ESC only waits EDITOR.input.esc_ms for the rest of a
+// sequence before it counts as the ESC key
+
+// reads what the terminal has sent, waiting at most `ms` for it.
+// returns how many bytes came in
+int editorInputFill(int ms){
+    struct editorInput *in = &EDITOR.input;
+    if(in->off){
+        memmove(in->buf, &in->buf[in->off], in->len - in->off);
+        in->len -= in->off;
+        in->off = 0;
+    }
+    if(in->len == KILONE_INPUT_BUF) return 0;
+
+    struct pollfd fd = {STDIN_FILENO, POLLIN, 0};
+    if(poll(&fd, 1, ms) <= 0) return 0;
+    ssize_t n = read(STDIN_FILENO, &in->buf[in->len], KILONE_INPUT_BUF - in->len);
+    if(n == -1 && (errno == EINTR || errno == EAGAIN)) return 0;
+    if(n <= 0) die("read");
+    in->len += n;
+    return n;
+}
+
+// the key of a CSI (ESC [) or SS3 (ESC O) sequence, by its final byte and
+// first parameter. modifiers are ignored, -1 if it is no key we know
+keycode editorSequenceKey(unsigned char final, int param){
+    switch(final){
+        case 'A': return CURSOR_UP;
+        case 'B': return CURSOR_DOWN;
+        case 'C': return CURSOR_RIGHT;
+        case 'D': return CURSOR_LEFT;
+        case 'H': return HOME_KEY;
+        case 'F': return END_KEY;
+        case '~':
+            switch(param){
+                case 1: case 7: return HOME_KEY;
+                case 4: case 8: return END_KEY;
+                case 3: return DEL_KEY;
+                case 5: return PAGE_UP;
+                case 6: return PAGE_DOWN;
+                case 200: return KILONE_PASTE_BEGIN;
+                case 201: return KILONE_PASTE_END;
+            }
+    }
+    return -1;
+}
+
+// decodes the key at the start of s[0, n). returns the bytes it took, or
+// 0 if they may still be the start of a longer sequence
+int editorDecodeKey(unsigned char *s, int n, keycode *key){
+    *key = s[0];
+    if(s[0] != '\x1b') return 1;
+    if(n == 1) return 0;
+
+    if(s[1] == 'O'){
+        if(n == 2) return 0;
+        *key = editorSequenceKey(s[2], 0);
+        return 3;
+    }
+    if(s[1] != '['){
+        // alt and a key, the key comes next
+        return 1;
+    }
+
+    // only the first parameter matters
+    int j, param = 0, first = 1;
+    for(j = 2; j < n; j++){
+        if(s[j] >= '0' && s[j] <= '9'){
+            if(first && param < 1000) param = param * 10 + s[j] - '0';
+        } else if(s[j] == ';'){
+            first = 0;
+        } else if(s[j] >= 0x40 && s[j] <= 0x7e){
+            *key = editorSequenceKey(s[j], param);
+            return j + 1;
+        } else if(s[j] < 0x20 || s[j] > 0x3f){
+            // not a sequence after all
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// the next key if the terminal sent one, only waiting for the rest of an
+// escape sequence. -1 if there is none
+keycode editorNextKey(){
+    struct editorInput *in = &EDITOR.input;
+    while(1){
+        if(in->off == in->len && !editorInputFill(0)) return -1;
+
+        keycode key;
+        int n = editorDecodeKey(&in->buf[in->off], in->len - in->off, &key);
+        if(n == 0){
+            if(editorInputFill(in->esc_ms)) continue;
+            // nothing followed, it was the ESC key
+            n = 1;
+        }
+        in->off += n;
+        if(key != -1) return key;
+    }
+}
+
+// reads the text of a bracketed paste up to its end marker into
+// EDITOR.paste. the terminal sends line breaks as \r or \r\n, they
+// become \n
+void editorReadPaste(){
+    int prev = 0;
+    long idle = editorNowMs(); // nothing came in since
+    int got = 0;
+    abReset(&EDITOR.paste);
+    while(1){
+        keycode c = editorNextKey();
+        if(c == -1){
+            long now = editorNowMs();
+            if(got) idle = now;
+            got = 0;
+            // the end marker got lost, keep what came so far
+            if(now - idle >= KILONE_PASTE_MS) break;
+            editorInputFill(idle + KILONE_PASTE_MS - now);
+            continue;
+        }
+        got = 1;
+        if(c == KILONE_PASTE_END) break;
+        // keys sent as escape sequences in the text
+        if(c > 255) continue;
+
+        if(c == '\n' && prev == '\r') continue;
+        prev = c;
+        char ch = (c == '\r')? '\n' : c;
+        abAppend(&EDITOR.paste, &ch, 1);
+    }
+}
+
+// whether a key is already waiting, without blocking for one
+int editorKeyPending(){
+    if(EDITOR.input.next == -1) EDITOR.input.next = editorNextKey();
+    return EDITOR.input.next != -1;
+}
+
+// waits for a key. if anything else happens first, a timer or a worker
+// with news, KILONE_TICK comes back so the screen can catch up
 keycode editorReadKey(){
-    // ncurses version of the code
-    keycode c = '\0';
-    if((c = getch()) == ERR){
-        die("getch");
+    keycode c = EDITOR.input.next;
+    EDITOR.input.next = -1;
+    if(c == -1) c = editorNextKey();
+    if(c == -1){
+        loopWait();
+        if((c = editorNextKey()) == -1) return KILONE_TICK;
     }
 
-    // rebinding ncurses codes to the editorKey struct
     switch(c){
-        case KEY_BACKSPACE: return BACKSPACE;
-        case KEY_LEFT: return CURSOR_LEFT;
-        case KEY_RIGHT: return CURSOR_RIGHT;
-        case KEY_UP: return CURSOR_UP;
-        case KEY_DOWN: return CURSOR_DOWN;
-        case KEY_DC: return DEL_KEY;
-        case KEY_HOME: return HOME_KEY;
-        case KEY_END: return END_KEY;
-        case KEY_PPAGE: return PAGE_UP;
-        case KEY_NPAGE: return PAGE_DOWN;
         case CTRL('e'): return KILONE_QUIT;
         case CTRL('w'): return KILONE_SAVE;
+        case KILONE_PASTE_BEGIN:
+            editorReadPaste();
+            return KILONE_PASTE;
     }
 
     return c;
@@ -911,8 +4479,11 @@ void editorExecuteCommand(){
     // TODO find a better way to do this without needing to hardcode everything
     // TODO allow whatever scripting language to have access to this functionality
     if(strcmp("wq", command) == 0){
+        editorSaveWait();
         editorSave();
-        goto ON_COMMAND_EXIT;
+        editorSaveWait();
+        // stay if the save failed
+        if(EDITOR.dirty == 0) goto ON_COMMAND_EXIT;
     }
     if(strcmp("q", command) == 0){
         if(EDITOR.dirty) {
@@ -941,17 +4512,21 @@ void editorExecuteCommand(){
     if(command){
         free(command);
     }
+    // never leave a save half written
+    editorSaveWait();
 
     clear();
     move(0,0);
+    write(STDOUT_FILENO, "\x1b[?2004l", 8);
 
     exit(0);
 }
 
 void editorMoveCursor(keycode key){
+    editorIndexRows(EDITOR.cy + 1);
     erow *row = (EDITOR.cy >= EDITOR.numrows)?
         NULL :
-        &EDITOR.row[EDITOR.cy];
+        editorRowAt(EDITOR.cy);
 
     switch(key){
         case CURSOR_LEFT:
@@ -959,7 +4534,7 @@ void editorMoveCursor(keycode key){
                 EDITOR.cx--;
             } else if (EDITOR.cy > 0){
                 EDITOR.cy--;
-                EDITOR.cx = EDITOR.row[EDITOR.cy].size;
+                EDITOR.cx = editorRowAt(EDITOR.cy)->size;
             }
             break;
         case CURSOR_RIGHT:
@@ -984,7 +4559,7 @@ void editorMoveCursor(keycode key){
 
     row = (EDITOR.cy >= EDITOR.numrows)?
         NULL :
-        &EDITOR.row[EDITOR.cy];
+        editorRowAt(EDITOR.cy);
     int rowlen = row ? row->size : 0;
     if(EDITOR.cx > rowlen){
         EDITOR.cx = rowlen;
@@ -993,7 +4568,10 @@ void editorMoveCursor(keycode key){
 
 void editorProcessKeyPress(){
     keycode c = editorReadKey();
+    if(c == KILONE_TICK) return;
 
+    // make sure the rows around the cursor exist before editing them
+    editorIndexRows(EDITOR.cy + 1);
     EDITOR.keybindCallback(c);
 }
 
@@ -1006,6 +4584,12 @@ void keybindNormalModeCallback(keycode c){
         case ':':
             editorExecuteCommand();
             break;
+        case 'u':
+            editorUndo();
+            break;
+        case CTRL_KEY('r'):
+            editorRedo();
+            break;
         // TODO: implement more keybinds
             // 'dd' and the 'd' family(heh): delete the line/word/etc...
             // 'v' and the 'v' family: visual mode
@@ -1057,6 +4641,12 @@ void keybindInsertModeCallback(keycode c){
         case CTRL_KEY('f'):
             editorFind();
             break;
+        case KILONE_PASTE:
+            editorInsertText(EDITOR.paste.b, EDITOR.paste.len);
+            break;
+        // an end marker without its paste, not text
+        case KILONE_PASTE_END:
+            break;
         case BACKSPACE:
         case CTRL_KEY('h'):
         case DEL_KEY:
@@ -1124,7 +4714,12 @@ void initEditor() {
     EDITOR.rowoff = 0;
     EDITOR.coloff = 0;
     EDITOR.numrows = 0;
-    EDITOR.row = NULL;
+    EDITOR.rows = NULL;
+    EDITOR.hl_clean = 0;
+    EDITOR.hl_resume = 0;
+    EDITOR.map = NULL;
+    EDITOR.mapsize = 0;
+    EDITOR.mapoff = 0;
     EDITOR.dirty = 0;
     EDITOR.filename = NULL;
     EDITOR.statusmsg[0] = '\0';
@@ -1136,9 +4731,49 @@ void initEditor() {
     if(has_colors() == TRUE)
         editorInitializeColorPairs();
 
+    for(unsigned int j = 0; j < KILONE_HLDB_ENTRIES; j++)
+        editorCompileSyntax(&HLDB[j]);
+
     if(getWindowSize(&EDITOR.screenrows, &EDITOR.screencols) == -1)
         die("getWindowSize");
     EDITOR.screenrows -= 2;
+
+    EDITOR.renderer = KILONE_DEFAULT_RENDERER;
+    char *renderer = getenv("KILONE_RENDERER");
+    if(renderer && !strcmp(renderer, "vt"))
+        EDITOR.renderer = KILONE_RENDERER_VT;
+    else if(renderer && !strcmp(renderer, "curses"))
+        EDITOR.renderer = KILONE_RENDERER_CURSES;
+    if(EDITOR.renderer == KILONE_RENDERER_VT){
+        // let curses do its one time screen setup now, stdscr is never
+        // touched or refreshed again
+        refresh();
+    }
+    EDITOR.frame = (struct abuf)ABUF_INIT;
+    EDITOR.paste = (struct abuf)ABUF_INIT;
+
+    loopInit();
+    EDITOR.input.off = 0;
+    EDITOR.input.len = 0;
+    EDITOR.input.next = -1;
+    EDITOR.input.esc_ms = KILONE_ESC_MS;
+    char *esc_ms = getenv("KILONE_ESC_MS");
+    if(esc_ms){
+        // a negative timeout would make poll wait forever
+        char *end;
+        long ms = strtol(esc_ms, &end, 10);
+        if(end != esc_ms && *end == '\0' && ms >= 0 && ms <= INT_MAX)
+            EDITOR.input.esc_ms = ms;
+    }
+
+    if(pthread_mutex_init(&EDITOR.search.lock, NULL) != 0)
+        die("pthread_mutex_init");
+
+    EDITOR.damage = malloc(EDITOR.screenrows + 2);
+    if(EDITOR.damage == NULL) die("malloc");
+    editorDamageAll();
+    EDITOR.drawn_rowoff = 0;
+    EDITOR.drawn_coloff = 0;
 }
 
 int main(int argc, char* argv[]){
@@ -1151,9 +4786,17 @@ int main(int argc, char* argv[]){
 
     editorSetStatusMessage("HELP: ':wq' = save and quit | ':q' & ':q!' = quit without saving |  Ctrl-F = find");
 
+    long drawn = 0;
     while(1){
-        refresh();
-        editorRefreshScreen();
+        // keys that are already waiting get handled before the next frame,
+        // and while they keep coming frames go out at most KILONE_FPS
+        // times a second. once input is idle the last state is drawn
+        // right away
+        long now = editorNowMs();
+        if(!editorKeyPending() || now - drawn >= 1000 / KILONE_FPS){
+            editorRefreshScreen();
+            drawn = now;
+        }
         editorProcessKeyPress();
     }
     return 0;